@@ -1,10 +1,24 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
 //
+// Buffers are hashed by (dev, blockno) into NHASH chains. The
+// chains are protected by NBUCKET locks, chain h by lock
+// h % NBUCKET, so lookups of different blocks rarely contend.
+// Each bucket also keeps its unused (refcnt 0) buffers on a
+// list in the order they were released. When a block is not
+// cached, the oldest of the buffers at the heads of those
+// lists is recycled; bcache.lock serializes recycling so that
+// two CPUs missing on the same block cannot both insert it.
+//
+// Buffers live in slabs allocated with kalloc(). binit() sizes
+// the cache to 1/BCACHEFRAC of free memory; when kalloc() runs
+// dry it calls bshrink() to give back a slab of unused buffers,
+// and bget() grows the cache again once memory is plentiful.
+//
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
 // * After changing buffer data, call bwrite to write it to disk.
@@ -23,33 +37,272 @@
 #include "fs.h"
 #include "buf.h"
 
-struct {
+#define NBUCKET 13   // number of chain locks
+#define NHASH 1021   // number of hash chains; prime, so blocks spread evenly
+#define BHASH(dev, blockno) ((((dev) << 16) ^ (blockno)) % NHASH)
+#define BLOCK(h) (&bcache.bucket[(h) % NBUCKET].lock)
+
+#define BPP (PGSIZE / BSIZE)        // blocks per data page
+#define SLABPAGES 9                 // data pages per slab
+#define SLABBUFS (SLABPAGES * BPP)  // buffers per slab
+
+// A slab of buffers: a page holding this descriptor, plus
+// SLABPAGES pages holding the buffers' data. The cache
+// grows and shrinks a slab at a time.
+struct bslab {
+  struct bslab *next;
+  char *page[SLABPAGES];
+  struct buf buf[SLABBUFS];
+};
+
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf free;  // circular list of unused buffers, through fprev/fnext
+};
+
+struct {
+  struct spinlock lock;  // held while recycling, adding or removing buffers
+  struct bucket bucket[NBUCKET];
+  struct buf *hash[NHASH];  // chains, through prev/next
+  struct bslab *slabs;
+  int nbuf;    // buffers in the cache
+  int target;  // size chosen at boot
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+  // statistics
+  int nhit;
+  int nmiss;
+  int nevict;
+  int nshrink;
+  int nprefetch;
 } bcache;
 
+static void
+chain_insert(struct buf **chain, struct buf *b)
+{
+  b->prev = 0;
+  b->next = *chain;
+  if(*chain)
+    (*chain)->prev = b;
+  *chain = b;
+}
+
+static void
+chain_remove(struct buf **chain, struct buf *b)
+{
+  if(b->prev)
+    b->prev->next = b->next;
+  else
+    *chain = b->next;
+  if(b->next)
+    b->next->prev = b->prev;
+  b->prev = b->next = 0;
+}
+
+// Put unused buffer b on a free list, after buffer a.
+// Caller must hold the list's bucket lock.
+static void
+free_insert(struct buf *a, struct buf *b)
+{
+  b->fprev = a;
+  b->fnext = a->fnext;
+  a->fnext->fprev = b;
+  a->fnext = b;
+}
+
+static void
+free_remove(struct buf *b)
+{
+  b->fprev->fnext = b->fnext;
+  b->fnext->fprev = b->fprev;
+  b->fprev = b->fnext = 0;
+}
+
+// Take a reference to b; an unused buffer leaves its free
+// list. Caller must hold the lock of b's chain.
+static void
+bref(struct buf *b)
+{
+  if(b->refcnt++ == 0)
+    free_remove(b);
+}
+
+// Drop a reference to b, which is in chain h; once unused,
+// it goes on the end of its bucket's free list, as the most
+// recently used. Caller must hold BLOCK(h).
+static void
+bunref(struct buf *b, int h)
+{
+  struct buf *free = &bcache.bucket[h % NBUCKET].free;
+
+  if(--b->refcnt == 0){
+    b->timestamp = ticks;
+    free_insert(free->fprev, b);
+  }
+}
+
+// Find the buffer for (dev, blockno) in chain.
+// Caller must hold the chain's lock.
+static struct buf*
+chain_find(struct buf *chain, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = chain; b != 0; b = b->next)
+    if(b->dev == dev && b->blockno == blockno)
+      return b;
+  return 0;
+}
+
+// Allocate a slab and add its buffers to the cache.
+// Returns 0 if memory is short.
+static int
+bgrow(void)
+{
+  struct bslab *s;
+  int i;
+
+  if((s = kalloc()) == 0)
+    return 0;
+  memset(s, 0, PGSIZE);
+  for(i = 0; i < SLABPAGES; i++){
+    if((s->page[i] = kalloc()) == 0){
+      while(--i >= 0)
+        kfree(s->page[i]);
+      kfree(s);
+      return 0;
+    }
+  }
+  for(i = 0; i < SLABBUFS; i++){
+    initsleeplock(&s->buf[i].lock, "buffer");
+    s->buf[i].data = (uchar*)s->page[i / BPP] + (i % BPP) * BSIZE;
+  }
+
+  // New buffers have dev 0, hold no block and are in no
+  // chain. They go at the heads of the free lists, spread
+  // over the buckets, to be the first recycled.
+  acquire(&bcache.lock);
+  for(i = 0; i < SLABBUFS; i++){
+    struct bucket *bk = &bcache.bucket[i % NBUCKET];
+    acquire(&bk->lock);
+    free_insert(&bk->free, &s->buf[i]);
+    release(&bk->lock);
+  }
+  s->next = bcache.slabs;
+  bcache.slabs = s;
+  bcache.nbuf += SLABBUFS;
+  release(&bcache.lock);
+  return 1;
+}
+
 void
 binit(void)
 {
-  struct buf *b;
+  int nslab;
+
+  if(sizeof(struct bslab) > PGSIZE)
+    panic("binit: bslab");
 
   initlock(&bcache.lock, "bcache");
+  for(int i = 0; i < NBUCKET; i++){
+    initlock(&bcache.bucket[i].lock, "bcache.bucket");
+    bcache.bucket[i].free.fprev = bcache.bucket[i].free.fnext = &bcache.bucket[i].free;
+  }
+
+  nslab = kgetfree() / PGSIZE / BCACHEFRAC / (SLABPAGES + 1);
+  if(nslab * SLABBUFS < NBUFMIN)
+    nslab = (NBUFMIN + SLABBUFS - 1) / SLABBUFS;
+  bcache.target = nslab * SLABBUFS;
+  while(bcache.nbuf < bcache.target)
+    if(bgrow() == 0)
+      panic("binit: out of memory");
+}
+
+// Free a slab whose buffers are all unused, unless that
+// would take the cache below NBUFMIN buffers. Called by
+// kalloc() when it runs out of pages, so it must not
+// allocate. Returns 1 if a slab was freed.
+int
+bshrink(void)
+{
+  struct bslab *s, **sp;
+  struct buf *b;
+  int i;
+
+  acquire(&bcache.lock);
+  if(bcache.nbuf - SLABBUFS < NBUFMIN){
+    release(&bcache.lock);
+    return 0;
+  }
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
-  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+  // Holding every chain lock keeps bget() from taking a
+  // reference to a buffer while we check and unlink it.
+  for(i = 0; i < NBUCKET; i++)
+    acquire(&bcache.bucket[i].lock);
+  for(sp = &bcache.slabs; (s = *sp) != 0; sp = &s->next){
+    for(i = 0; i < SLABBUFS; i++)
+      if(s->buf[i].refcnt != 0)
+        break;
+    if(i == SLABBUFS)
+      break;
+  }
+  if(s){
+    *sp = s->next;
+    for(i = 0; i < SLABBUFS; i++){
+      b = &s->buf[i];
+      free_remove(b);
+      if(b->dev != 0)
+        chain_remove(&bcache.hash[BHASH(b->dev, b->blockno)], b);
+    }
+    bcache.nbuf -= SLABBUFS;
+    bcache.nshrink++;
   }
+  for(i = NBUCKET - 1; i >= 0; i--)
+    release(&bcache.bucket[i].lock);
+  release(&bcache.lock);
+
+  if(s == 0)
+    return 0;
+  for(i = 0; i < SLABPAGES; i++)
+    kfree(s->page[i]);
+  kfree(s);
+  return 1;
+}
+
+// Remove the least recently used unused buffer from its
+// free list and chain, and return it. It is the oldest of
+// the buffers at the heads of the buckets' free lists.
+// Holds at most the lock of the best candidate so far plus
+// the one being looked at; only one CPU does this at a time
+// (caller holds bcache.lock), so the two-lock hold cannot
+// deadlock.
+static struct buf*
+bevict(void)
+{
+  struct buf *b, *victim = 0;
+  struct spinlock *held = 0;
+
+  for(int i = 0; i < NBUCKET; i++){
+    struct bucket *bk = &bcache.bucket[i];
+
+    acquire(&bk->lock);
+    b = bk->free.fnext;
+    if(b != &bk->free && (victim == 0 || b->timestamp < victim->timestamp)){
+      if(held)
+        release(held);
+      held = &bk->lock;
+      victim = b;
+    } else {
+      release(&bk->lock);
+    }
+  }
+
+  if(victim == 0)
+    panic("bget: no buffers");
+  free_remove(victim);
+  if(victim->dev != 0)
+    chain_remove(&bcache.hash[BHASH(victim->dev, victim->blockno)], victim);
+  release(held);
+  return victim;
 }
 
 // Look through buffer cache for block on device dev.
@@ -59,33 +312,57 @@ static struct buf*
 bget(uint dev, uint blockno)
 {
   struct buf *b;
-
-  acquire(&bcache.lock);
+  int h = BHASH(dev, blockno);
 
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+  acquire(BLOCK(h));
+  b = chain_find(bcache.hash[h], dev, blockno);
+  if(b){
+    bref(b);
+    release(BLOCK(h));
+    __sync_fetch_and_add(&bcache.nhit, 1);
+    acquiresleep(&b->lock);
+    return b;
   }
+  release(BLOCK(h));
+  __sync_fetch_and_add(&bcache.nmiss, 1);
 
-  // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+  // Not cached. If the cache was shrunk under memory
+  // pressure, grow it back once memory is plentiful.
+  if(bcache.nbuf < bcache.target &&
+     kgetfree() / PGSIZE > BCACHEFRAC * (SLABPAGES + 1))
+    bgrow();
+
+  // Check again under bcache.lock, since another CPU
+  // may have inserted the block after we looked.
+  acquire(&bcache.lock);
+  acquire(BLOCK(h));
+  b = chain_find(bcache.hash[h], dev, blockno);
+  if(b){
+    bref(b);
+    release(BLOCK(h));
+    release(&bcache.lock);
+    acquiresleep(&b->lock);
+    return b;
   }
-  panic("bget: no buffers");
+  release(BLOCK(h));
+
+  // Recycle the least recently used unused buffer.
+  // Only a CPU holding bcache.lock inserts buffers, so
+  // (dev, blockno) cannot appear in the meantime.
+  b = bevict();
+  if(b->dev != 0)
+    bcache.nevict++;
+  b->dev = dev;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->refcnt = 1;
+  acquire(BLOCK(h));
+  chain_insert(&bcache.hash[h], b);
+  release(BLOCK(h));
+  release(&bcache.lock);
+  acquiresleep(&b->lock);
+  return b;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -102,6 +379,106 @@ bread(uint dev, uint blockno)
   return b;
 }
 
+// Return a locked buf for the indicated block, filled with
+// zeros rather than read from the disk, for a block that has
+// just been allocated.
+struct buf*
+bnew(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno);
+  memset(b->data, 0, BSIZE);
+  b->valid = 1;
+  return b;
+}
+
+// Return the indicated block's buf, locked, if it is in
+// the cache; else 0, without reading it.
+struct buf*
+bfind(uint dev, uint blockno)
+{
+  struct buf *b;
+  int h = BHASH(dev, blockno);
+
+  acquire(BLOCK(h));
+  b = chain_find(bcache.hash[h], dev, blockno);
+  if(b)
+    bref(b);
+  release(BLOCK(h));
+  if(b)
+    acquiresleep(&b->lock);
+  return b;
+}
+
+// Queue reads of blocks blockno..blockno+n-1 into the cache,
+// without waiting for them; bkick() starts them. Runs of
+// blocks not already cached go to the disk as multi-block
+// requests. Each buffer stays locked until its read
+// completes, so a bread() of the block meanwhile waits for
+// it rather than issuing a second read.
+// Returns how many of the n blocks are now cached or on their
+// way; fewer than n only if the disk queue is full.
+int
+bprefetch(uint dev, uint blockno, int n)
+{
+  struct buf *b, *run[RAMAX];
+  int i, m, q, h, cached;
+
+  m = 0;
+  for(i = 0; i <= n; i++){
+    b = 0;
+    if(i < n){
+      h = BHASH(dev, blockno+i);
+      acquire(BLOCK(h));
+      cached = chain_find(bcache.hash[h], dev, blockno+i) != 0;
+      release(BLOCK(h));
+      if(!cached){
+        b = bget(dev, blockno+i);
+        if(b->valid){
+          brelse(b);
+          b = 0;
+        }
+      }
+    }
+
+    // start the run so far if it ends here.
+    if(m > 0 && (b == 0 || m == RAMAX)){
+      q = virtio_disk_read_async(run, m);
+      __sync_fetch_and_add(&bcache.nprefetch, q);
+      if(q < m){
+        for(int j = q; j < m; j++)
+          brelse(run[j]);
+        if(b)
+          brelse(b);
+        return i - m + q;
+      }
+      m = 0;
+    }
+    if(b)
+      run[m++] = b;
+  }
+  return n;
+}
+
+// Called by the disk interrupt when a read started by
+// bprefetch() completes. Like brelse(), but the sleep-lock
+// is held on behalf of whichever process started the read,
+// not the one that was interrupted.
+void
+breaddone(struct buf *b)
+{
+  int h;
+
+  b->valid = 1;
+  releasesleep(&b->lock);
+
+  h = BHASH(b->dev, b->blockno);
+  acquire(BLOCK(h));
+  bunref(b, h);
+  release(BLOCK(h));
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -111,43 +488,116 @@ bwrite(struct buf *b)
   virtio_disk_rw(b, 1);
 }
 
+// Queue a write of b's contents without waiting for it,
+// so that a batch of writes reaches the disk together.
+// b must stay locked until bwait(b) returns.
+void
+bwrite_async(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwrite_async");
+  virtio_disk_submit(b, 1);
+}
+
+// Like bwrite_async() for n locked bufs holding consecutive
+// blocks, which go to the disk as multi-block requests.
+void
+bwritev_async(struct buf **b, int n)
+{
+  for(int i = 0; i < n; i++)
+    if(!holdingsleep(&b[i]->lock))
+      panic("bwritev_async");
+  virtio_disk_submitv(b, n, 1);
+}
+
+// Wait for a write queued by bwrite_async() to finish.
+void
+bwait(struct buf *b)
+{
+  virtio_disk_wait(b);
+}
+
+// Start the disk on requests queued by bprefetch()
+// and bwrite_async().
+void
+bkick(void)
+{
+  virtio_disk_kick();
+}
+
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
+// Record the release time, for LRU recycling.
 void
 brelse(struct buf *b)
 {
+  int h;
+
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
-  b->refcnt--;
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
-  release(&bcache.lock);
+  h = BHASH(b->dev, b->blockno);
+  acquire(BLOCK(h));
+  bunref(b, h);
+  release(BLOCK(h));
+}
+
+// Mark locked buf b as holding file data that must be
+// written back, and pin it in the cache until it has been.
+// Returns 1 if b was clean.
+int
+bdirty(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bdirty");
+  if(b->dirty)
+    return 0;
+  b->dirty = 1;
+  bpin(b);
+  return 1;
+}
+
+// Mark locked buf b as written back, or as no longer worth
+// writing. Returns 1 if b was dirty.
+int
+bclean(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bclean");
+  if(!b->dirty)
+    return 0;
+  b->dirty = 0;
+  bunpin(b);
+  return 1;
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
-  b->refcnt++;
-  release(&bcache.lock);
+  int h = BHASH(b->dev, b->blockno);
+
+  acquire(BLOCK(h));
+  bref(b);
+  release(BLOCK(h));
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
-  b->refcnt--;
-  release(&bcache.lock);
-}
+  int h = BHASH(b->dev, b->blockno);
 
+  acquire(BLOCK(h));
+  bunref(b, h);
+  release(BLOCK(h));
+}
 
+// Print the buffer cache size and hit/miss counters,
+// for the statistics device.
+int
+statsbcache(char *buf, int sz)
+{
+  return snprintf(buf, sz,
+                  "--- bcache: nbuf %d hit %d miss %d evict %d shrink %d"
+                  " prefetch %d\n",
+                  bcache.nbuf, bcache.nhit, bcache.nmiss,
+                  bcache.nevict, bcache.nshrink, bcache.nprefetch);
+}
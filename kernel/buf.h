@@ -1,12 +1,16 @@
 struct buf {
   int valid;   // has data been read from disk?
   int disk;    // does disk "own" buf?
+  int dirty;   // file data to write back, not logged; pinned while set
   uint dev;
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  uint timestamp;   // ticks at last release, for LRU
+  struct buf *prev; // hash bucket list
   struct buf *next;
-  uchar data[BSIZE];
+  struct buf *fprev; // bucket's list of unused buffers, oldest first
+  struct buf *fnext;
+  uchar *data;      // BSIZE bytes in a slab page
 };
 
@@ -0,0 +1,207 @@
+// Directory entry (name lookup) cache.
+//
+// Maps (dev, directory inum, name) to the inum of the entry
+// and its byte offset in the directory, so that dirlookup()
+// need not scan the directory's blocks. An entry with inum 0
+// is negative: it records that the name is not present.
+//
+// The cache must agree with the directories on disk, so
+// every change to a directory's entries updates it:
+// dirlink() enters the new name, sys_unlink() forgets the
+// removed one, and freeing a directory purges its entries.
+// Callers hold the directory's ip->lock, which orders
+// lookups and changes of the same directory; dcache.lock
+// only protects the table itself.
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "fs.h"
+
+#define NDHASH 509  // number of hash chains; prime
+
+struct dentry {
+  uint dev;
+  uint dir;           // inum of the directory; 0 if unused
+  char name[DIRSIZ];
+  uint inum;          // inum of the entry; 0 if negative
+  uint off;           // byte offset of the entry in dir
+  struct dentry *hnext;  // hash chain
+  struct dentry *lprev;  // LRU list, least recent first
+  struct dentry *lnext;
+};
+
+struct {
+  struct spinlock lock;
+  struct dentry *hash[NDHASH];
+  struct dentry lru;
+  struct dentry dentry[NDENTRY];
+
+  // statistics
+  int nhit;
+  int nmiss;
+} dcache;
+
+static uint
+dhash(uint dev, uint dir, char *name)
+{
+  uint h = (dev << 16) ^ dir;
+
+  for(int i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + (uchar)name[i];
+  return h % NDHASH;
+}
+
+static void
+lru_remove(struct dentry *d)
+{
+  d->lprev->lnext = d->lnext;
+  d->lnext->lprev = d->lprev;
+}
+
+// Make d the most recently used entry.
+static void
+lru_append(struct dentry *d)
+{
+  d->lnext = &dcache.lru;
+  d->lprev = dcache.lru.lprev;
+  dcache.lru.lprev->lnext = d;
+  dcache.lru.lprev = d;
+}
+
+static void
+hash_remove(struct dentry *d)
+{
+  struct dentry **pp;
+
+  for(pp = &dcache.hash[dhash(d->dev, d->dir, d->name)]; *pp; pp = &(*pp)->hnext){
+    if(*pp == d){
+      *pp = d->hnext;
+      break;
+    }
+  }
+  d->hnext = 0;
+}
+
+// Drop d from the cache, and make it the next to be reused.
+static void
+dfree(struct dentry *d)
+{
+  hash_remove(d);
+  d->dir = 0;
+  lru_remove(d);
+  d->lnext = dcache.lru.lnext;
+  d->lprev = &dcache.lru;
+  dcache.lru.lnext->lprev = d;
+  dcache.lru.lnext = d;
+}
+
+// Caller holds dcache.lock.
+static struct dentry*
+dfind(uint dev, uint dir, char *name)
+{
+  struct dentry *d;
+
+  for(d = dcache.hash[dhash(dev, dir, name)]; d; d = d->hnext)
+    if(d->dev == dev && d->dir == dir && namecmp(d->name, name) == 0)
+      return d;
+  return 0;
+}
+
+void
+dcacheinit(void)
+{
+  initlock(&dcache.lock, "dcache");
+  dcache.lru.lnext = dcache.lru.lprev = &dcache.lru;
+  for(int i = 0; i < NDENTRY; i++)
+    lru_append(&dcache.dentry[i]);
+}
+
+// Look up name in directory dir. Returns 1 and sets *inum
+// (0 if the name is known to be absent) and *off if the
+// cache knows the answer, 0 if it doesn't.
+int
+dcache_lookup(uint dev, uint dir, char *name, uint *inum, uint *off)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  d = dfind(dev, dir, name);
+  if(d == 0){
+    dcache.nmiss++;
+    release(&dcache.lock);
+    return 0;
+  }
+  dcache.nhit++;
+  *inum = d->inum;
+  *off = d->off;
+  lru_remove(d);
+  lru_append(d);
+  release(&dcache.lock);
+  return 1;
+}
+
+// Record that name in directory dir is the entry at byte
+// offset off, for inode inum; or, if inum is 0, that the
+// directory has no such entry.
+void
+dcache_enter(uint dev, uint dir, char *name, uint inum, uint off)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if((d = dfind(dev, dir, name)) != 0){
+    lru_remove(d);
+  } else {
+    // reuse the least recently used entry.
+    d = dcache.lru.lnext;
+    lru_remove(d);
+    if(d->dir != 0)
+      hash_remove(d);
+    d->dev = dev;
+    d->dir = dir;
+    strncpy(d->name, name, DIRSIZ);
+    d->hnext = dcache.hash[dhash(dev, dir, name)];
+    dcache.hash[dhash(dev, dir, name)] = d;
+  }
+  d->inum = inum;
+  d->off = off;
+  lru_append(d);
+  release(&dcache.lock);
+}
+
+// Forget what the cache knows about name in directory dir.
+void
+dcache_forget(uint dev, uint dir, char *name)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if((d = dfind(dev, dir, name)) != 0)
+    dfree(d);
+  release(&dcache.lock);
+}
+
+// Forget all entries of directory dir, which is being
+// freed; its inum may be reused for another directory.
+void
+dcache_purge(uint dev, uint dir)
+{
+  acquire(&dcache.lock);
+  for(int i = 0; i < NDENTRY; i++){
+    struct dentry *d = &dcache.dentry[i];
+    if(d->dir == dir && d->dev == dev)
+      dfree(d);
+  }
+  release(&dcache.lock);
+}
+
+// Print the name cache counters, for the statistics device.
+int
+statsdcache(char *buf, int sz)
+{
+  return snprintf(buf, sz, "--- dcache: hit %d miss %d\n",
+                  dcache.nhit, dcache.nmiss);
+}
@@ -15,10 +15,22 @@ struct vma;
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
+struct buf*     bnew(uint, uint);
+struct buf*     bfind(uint, uint);
+int             bdirty(struct buf*);
+int             bclean(struct buf*);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+int             bshrink(void);
+int             bprefetch(uint, uint, int);
+void            breaddone(struct buf*);
+void            bwrite_async(struct buf*);
+void            bwritev_async(struct buf**, int);
+void            bwait(struct buf*);
+void            bkick(void);
+int             statsbcache(char*, int);
 
 // console.c
 void            consoleinit(void);
@@ -37,6 +49,7 @@ void            fileinit(void);
 int             fileread(struct file*, uint64, int n);
 int             filestat(struct file*, uint64 addr);
 int             filewrite(struct file*, uint64, int n);
+int             filewriteat(struct file*, char*, uint, int);
 
 // fs.c
 void            fsinit(int);
@@ -54,9 +67,32 @@ int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
+char*           igetpage(struct inode*, uint);
+uint            ireadahead(struct inode*, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
 void            itrunc(struct inode*);
+void            bcommitted(uint);
+int             iwriteback(struct inode*);
+void            isync(struct inode*);
+void            wbthrottle(void);
+
+// dcache.c
+void            dcacheinit(void);
+int             dcache_lookup(uint, uint, char*, uint*, uint*);
+void            dcache_enter(uint, uint, char*, uint, uint);
+void            dcache_forget(uint, uint, char*);
+void            dcache_purge(uint, uint);
+int             statsdcache(char*, int);
+
+// pcache.c
+void            pcacheinit(void);
+char*           pcache_lookup(uint, uint, uint);
+void            pcache_insert(uint, uint, uint, char*);
+void            pcache_update(uint, uint, uint, char*, uint);
+void            pcache_inval(uint, uint);
+int             pcache_shrink(void);
+int             statspcache(char*, int);
 
 // ramdisk.c
 void            ramdiskinit(void);
@@ -64,18 +100,32 @@ void            ramdiskintr(void);
 void            ramdiskrw(struct buf*);
 
 // kalloc.c
+extern char     *zeropage;
 void*           kalloc(void);
 void            kfree(void *);
 void            kinit(void);
 uint64          kgetfree(void);
-void            kdecref(uint64);
+void*           khugealloc(void);
+void            khugefree(void *);
+void*           allocpages(int);
+void            freepages(void *, int);
+int             statskalloc(char*, int);
+void            kgethuge(uint64*, uint64*);
+int             kdecref(uint64);
 void            kincref(uint64);
+int             kgetref(uint64);
 
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
 void            begin_op(void);
 void            end_op(void);
+void            begin_opn(int);
+void            end_opn(int);
+uint            logtid(void);
+void            logsync(void);
+int             logcapacity(void);
+int             statslog(char*, int);
 
 // pipe.c
 int             pipealloc(struct file**, struct file**);
@@ -113,6 +163,7 @@ int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
 uint64          numproc(void);
+int             kthread_create(char*, void (*)(void));
 
 // swtch.S
 void            swtch(struct context*, struct context*);
@@ -121,9 +172,12 @@ void            swtch(struct context*, struct context*);
 void            acquire(struct spinlock*);
 int             holding(struct spinlock*);
 void            initlock(struct spinlock*, char*);
+void            initlockunreg(struct spinlock*, char*);
 void            release(struct spinlock*);
 void            push_off(void);
 void            pop_off(void);
+void            freelock(struct spinlock*);
+int             statslock(char*, int);
 
 // sleeplock.c
 void            acquiresleep(struct sleeplock*);
@@ -131,6 +185,12 @@ void            releasesleep(struct sleeplock*);
 int             holdingsleep(struct sleeplock*);
 void            initsleeplock(struct sleeplock*, char*);
 
+// sprintf.c
+int             snprintf(char*, int, char*, ...);
+
+// stats.c
+void            statsinit(void);
+
 // string.c
 int             memcmp(const void*, const void*, uint);
 void*           memmove(void*, const void*, uint);
@@ -154,6 +214,9 @@ void            trapinit(void);
 void            trapinithart(void);
 extern struct spinlock tickslock;
 void            usertrapret(void);
+int             ldvma(uint64);
+int             vmaload(struct vma*, uint64);
+int             ldheap(uint64, int);
 
 // uart.c
 void            uartinit(void);
@@ -176,7 +239,13 @@ void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
 pte_t*          walk(pagetable_t pagetable, uint64 va, int alloc);
+pte_t*          walklevel(pagetable_t, uint64, int, int);
+int             uvmsplit(pagetable_t, uint64);
+int             uvmcowhuge(pagetable_t, uint64);
 uint64          walkaddr(pagetable_t, uint64);
+int             statskvm(char*, int);
+uint64          vmfault(pagetable_t, uint64, int);
+int             vmprefault(uint64, int, int);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
 int             copyinstr(pagetable_t, char *, uint64, uint64);
@@ -191,6 +260,11 @@ void            plic_complete(int);
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_submit(struct buf *, int);
+void            virtio_disk_submitv(struct buf **, int, int);
+void            virtio_disk_kick(void);
+void            virtio_disk_wait(struct buf *);
+int             virtio_disk_read_async(struct buf **, int);
 void            virtio_disk_intr(void);
 
 // number of elements in fixed-size array
@@ -217,4 +291,12 @@ int             sockwrite(struct sock *, uint64, int);
 void            sockrecvudp(struct mbuf*, uint32, uint16, uint16);
 
 // mm.c
+void            vmainit(void);
+struct vma*     vmaalloc(void);
+void            vmaput(struct vma*);
+int             vmaspace(struct proc*);
+struct vma*     vmalookup(uint64);
+int             vmaoverlap(uint64, uint64);
+void            vmaadd(struct vma*);
+int             vmacopy(struct proc*, struct proc*);
 void            clear_vma(void);
\ No newline at end of file
@@ -8,12 +8,17 @@
 #include "e1000_dev.h"
 #include "net.h"
 
+// the descriptor rings are read and written by the e1000
+// itself, so each is a block of contiguous pages from
+// allocpages(), of RING_ORDER.
+#define RING_ORDER 0
+
 #define TX_RING_SIZE 16
-static struct tx_desc tx_ring[TX_RING_SIZE] __attribute__((aligned(16)));
+static struct tx_desc *tx_ring;
 static struct mbuf *tx_mbufs[TX_RING_SIZE];
 
 #define RX_RING_SIZE 16
-static struct rx_desc rx_ring[RX_RING_SIZE] __attribute__((aligned(16)));
+static struct rx_desc *rx_ring;
 static struct mbuf *rx_mbufs[RX_RING_SIZE];
 
 // remember where the e1000's registers live.
@@ -39,20 +44,27 @@ e1000_init(uint32 *xregs)
   regs[E1000_IMS] = 0; // redisable interrupts
   __sync_synchronize();
 
+  if(TX_RING_SIZE*sizeof(struct tx_desc) > (PGSIZE << RING_ORDER) ||
+     RX_RING_SIZE*sizeof(struct rx_desc) > (PGSIZE << RING_ORDER))
+    panic("e1000: ring size");
+  if((tx_ring = allocpages(RING_ORDER)) == 0 ||
+     (rx_ring = allocpages(RING_ORDER)) == 0)
+    panic("e1000: rings");
+
   // [E1000 14.5] Transmit initialization
-  memset(tx_ring, 0, sizeof(tx_ring));
+  memset(tx_ring, 0, TX_RING_SIZE*sizeof(struct tx_desc));
   for (i = 0; i < TX_RING_SIZE; i++) {
     tx_ring[i].status = E1000_TXD_STAT_DD;
     tx_mbufs[i] = 0;
   }
   regs[E1000_TDBAL] = (uint64) tx_ring;
-  if(sizeof(tx_ring) % 128 != 0)
+  if(TX_RING_SIZE*sizeof(struct tx_desc) % 128 != 0)
     panic("e1000");
-  regs[E1000_TDLEN] = sizeof(tx_ring);
+  regs[E1000_TDLEN] = TX_RING_SIZE*sizeof(struct tx_desc);
   regs[E1000_TDH] = regs[E1000_TDT] = 0;
   
   // [E1000 14.4] Receive initialization
-  memset(rx_ring, 0, sizeof(rx_ring));
+  memset(rx_ring, 0, RX_RING_SIZE*sizeof(struct rx_desc));
   for (i = 0; i < RX_RING_SIZE; i++) {
     rx_mbufs[i] = mbufalloc(0);
     if (!rx_mbufs[i])
@@ -60,11 +72,11 @@ e1000_init(uint32 *xregs)
     rx_ring[i].addr = (uint64) rx_mbufs[i]->head;
   }
   regs[E1000_RDBAL] = (uint64) rx_ring;
-  if(sizeof(rx_ring) % 128 != 0)
+  if(RX_RING_SIZE*sizeof(struct rx_desc) % 128 != 0)
     panic("e1000");
   regs[E1000_RDH] = 0;
   regs[E1000_RDT] = RX_RING_SIZE - 1;
-  regs[E1000_RDLEN] = sizeof(rx_ring);
+  regs[E1000_RDLEN] = RX_RING_SIZE*sizeof(struct rx_desc);
 
   // filter by qemu's MAC address, 52:54:00:12:34:56
   regs[E1000_RA] = 0x12005452;
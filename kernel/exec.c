@@ -4,20 +4,27 @@
 #include "riscv.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
 #include "defs.h"
 #include "elf.h"
+#include "fcntl.h"
 
-static int loadseg(pde_t *pgdir, uint64 addr, struct inode *ip, uint offset, uint sz);
+#define NEXECSEG 4  // max loadable segments in a program
+
+static int segvma(struct proghdr *ph, struct vma *v);
 
 int
 exec(char *path, char **argv)
 {
   char *s, *last;
-  int i, off;
+  int i, off, nseg = 0;
   uint64 argc, sz = 0, sp, ustack[MAXARG], stackbase;
   struct elfhdr elf;
   struct inode *ip;
   struct proghdr ph;
+  struct vma v, *seg[NEXECSEG];
   pagetable_t pagetable = 0, oldpagetable;
   struct proc *p = myproc();
 
@@ -38,24 +45,24 @@ exec(char *path, char **argv)
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
 
-  // Load program into memory.
+  // Map the program's segments. Nothing is read yet: the
+  // pages are loaded when first touched, by ldvma().
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
       goto bad;
-    if(ph.type != ELF_PROG_LOAD)
+    if(ph.type != ELF_PROG_LOAD || ph.memsz == 0)
       continue;
-    if(ph.memsz < ph.filesz)
-      goto bad;
-    if(ph.vaddr + ph.memsz < ph.vaddr)
-      goto bad;
-    uint64 sz1;
-    if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz)) == 0)
+    if(nseg == NEXECSEG || PGROUNDDOWN(ph.vaddr) < sz)
       goto bad;
-    sz = sz1;
-    if((ph.vaddr % PGSIZE) != 0)
-      goto bad;
-    if(loadseg(pagetable, ph.vaddr, ip, ph.off, ph.filesz) < 0)
+    if(segvma(&ph, &v) < 0 || (seg[nseg] = vmaalloc()) == 0)
       goto bad;
+    *seg[nseg] = v;
+    seg[nseg]->ip = idup(ip);
+    // the text is shared from the page cache: keep writes
+    // out while it runs. ip is locked, as iwrite() holds it.
+    __sync_fetch_and_add(&ip->nexec, 1);
+    sz = v.addr + v.length;
+    nseg++;
   }
   iunlockput(ip);
   end_op();
@@ -64,6 +71,9 @@ exec(char *path, char **argv)
   p = myproc();
   uint64 oldsz = p->sz;
 
+  if(vmaspace(p) < 0)
+    goto bad;
+
   // Allocate two pages at the next page boundary.
   // Use the second as the user stack.
   sz = PGROUNDUP(sz);
@@ -109,6 +119,10 @@ exec(char *path, char **argv)
   safestrcpy(p->name, last, sizeof(p->name));
     
   // Commit to the user image.
+  clear_vma();
+  for(i = 0; i < nseg; i++)
+    vmaadd(seg[i]);
+  nseg = 0;
   oldpagetable = p->pagetable;
   p->pagetable = pagetable;
   p->sz = sz;
@@ -128,30 +142,41 @@ exec(char *path, char **argv)
     iunlockput(ip);
     end_op();
   }
+  for(i = 0; i < nseg; i++)
+    vmaput(seg[i]);
   return -1;
 }
 
-// Load a program segment into pagetable at virtual address va.
-// va must be page-aligned
-// and the pages from va to va+sz must already be mapped.
-// Returns 0 on success, -1 on failure.
+// Describe loadable segment ph as a VMA of the new image.
+// The VMA starts at the page holding ph->vaddr, so the file
+// offset of its first page is page-aligned whenever
+// ph->off and ph->vaddr agree modulo PGSIZE, as the linker
+// arranges; then its pages can be mapped from the page
+// cache, and shared by every process running the program.
+// Returns 0 on success, -1 on a bad header.
 static int
-loadseg(pagetable_t pagetable, uint64 va, struct inode *ip, uint offset, uint sz)
+segvma(struct proghdr *ph, struct vma *v)
 {
-  uint i, n;
-  uint64 pa;
-
-  for(i = 0; i < sz; i += PGSIZE){
-    pa = walkaddr(pagetable, va + i);
-    if(pa == 0)
-      panic("loadseg: address should exist");
-    if(sz - i < PGSIZE)
-      n = sz - i;
-    else
-      n = PGSIZE;
-    if(readi(ip, 0, (uint64)pa, offset+i, n) != n)
-      return -1;
-  }
-  
+  uint64 pad = ph->vaddr % PGSIZE;
+
+  if(ph->memsz < ph->filesz)
+    return -1;
+  if(ph->vaddr + ph->memsz < ph->vaddr || ph->vaddr + ph->memsz > TRAPFRAME)
+    return -1;
+  if(ph->off < pad)
+    return -1;
+
+  memset(v, 0, sizeof(*v));
+  v->addr = ph->vaddr - pad;
+  v->length = PGROUNDUP(ph->vaddr + ph->memsz) - v->addr;
+  v->offset = ph->off - pad;
+  v->filelen = ph->filesz + pad;
+  v->flags = MAP_PRIVATE;
+  if(ph->flags & ELF_PROG_FLAG_READ)
+    v->perm |= PROT_READ;
+  if(ph->flags & ELF_PROG_FLAG_WRITE)
+    v->perm |= PROT_WRITE;
+  if(ph->flags & ELF_PROG_FLAG_EXEC)
+    v->perm |= PROT_EXEC;
   return 0;
 }
@@ -11,4 +11,15 @@
 #define PROT_EXEC       0x4
 
 #define MAP_SHARED      0x01
-#define MAP_PRIVATE     0x02
\ No newline at end of file
+#define MAP_PRIVATE     0x02
+
+#define MAP_POPULATE    0x08
+
+#define MADV_NORMAL     0
+#define MADV_RANDOM     1
+#define MADV_SEQUENTIAL 2
+#define MADV_WILLNEED   3
+#define MADV_DONTNEED   4
+
+#define MS_ASYNC        0x1
+#define MS_SYNC         0x4
\ No newline at end of file
@@ -13,6 +13,10 @@
 #include "stat.h"
 #include "proc.h"
 
+#define RAMIN 4  // initial read-ahead window, in blocks
+#define OVERHEAD (1+8+2+2)  // log blocks a write may dirty besides its data
+#define WBCHUNK 64  // blocks per write-back transaction, so NDIRTY is not overshot far
+
 struct devsw devsw[NDEV];
 struct {
   struct spinlock lock;
@@ -115,6 +119,37 @@ filestat(struct file *f, uint64 addr)
   return -1;
 }
 
+// Sequential read detection for fileread(), after a read
+// of n bytes at f->off. If the read started where the last
+// one ended, prefetch the window of blocks that follows it,
+// doubling the window up to RAMAX on each sequential read;
+// any other read resets the window. Caller holds f->ip->lock.
+static void
+readahead(struct file *f, int n)
+{
+  uint start, end;
+
+  if(f->off != f->ranext){
+    f->rawin = 0;
+    f->rablock = 0;
+  } else if(f->rawin == 0){
+    f->rawin = RAMIN;
+  } else if(f->rawin < RAMAX){
+    f->rawin *= 2;
+  }
+  f->ranext = f->off + n;
+  if(f->rawin == 0)
+    return;
+
+  // don't prefetch blocks an earlier call already asked for.
+  start = (f->off + n + BSIZE - 1) / BSIZE;
+  end = start + f->rawin;
+  if(start < f->rablock)
+    start = f->rablock;
+  if(start < end)
+    f->rablock = start + ireadahead(f->ip, start, end - start);
+}
+
 // Read from file f.
 // addr is a user virtual address.
 int
@@ -133,8 +168,10 @@ fileread(struct file *f, uint64 addr, int n)
     r = devsw[f->major].read(1, addr, n);
   } else if(f->type == FD_INODE){
     ilock(f->ip);
-    if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
+    if((r = readi(f->ip, 1, addr, f->off, n)) > 0){
+      readahead(f, r);
       f->off += r;
+    }
     iunlock(f->ip);
   } else if(f->type == FD_SOCK){
     r = sockread(f->sock, addr, n);
@@ -145,12 +182,65 @@ fileread(struct file *f, uint64 addr, int n)
   return r;
 }
 
+// Write n bytes from addr to ip at *off, advancing *off.
+// If user_src==1, then addr is a user virtual address;
+// otherwise, it is a kernel address. Returns n, or -1.
+// A running program's file can't be written: its text
+// pages are the page cache's.
+static int
+iwrite(struct inode *ip, int user_src, uint64 addr, uint *off, int n)
+{
+  int r = 0;
+
+  // write as much at a time as one log transaction
+  // allows. a write of n1 bytes reserves its data blocks
+  // plus OVERHEAD: the i-node, up to eight extent-tree
+  // nodes, up to two bitmap blocks, and 2 blocks of slop
+  // for non-aligned writes. (a transaction holds fewer than
+  // 3*NEXTNODE blocks, so even if each block is its own
+  // extent a write fills at most three new leaves, and
+  // spans at most two bitmap blocks; an old-style inode
+  // dirties at most three indirect blocks.)
+  // this really belongs lower down, since writei()
+  // might be writing a device like the console.
+  // data written back by the flusher doesn't use the log,
+  // but the writer waits between chunks if too much of it
+  // is dirty.
+  int wb = iwriteback(ip);
+  int max = (wb ? WBCHUNK : logcapacity() - OVERHEAD) * BSIZE;
+  int i = 0;
+  while(i < n){
+    int n1 = n - i;
+    if(n1 > max)
+      n1 = max;
+
+    int nblk = (wb ? 0 : n1/BSIZE) + OVERHEAD;
+    begin_opn(nblk);
+    ilock(ip);
+    if (ip->nexec > 0)
+      r = -1;
+    else if ((r = writei(ip, user_src, addr + i, *off, n1)) > 0)
+      *off += r;
+    iunlock(ip);
+    end_opn(nblk);
+    if(wb)
+      wbthrottle();
+
+    if(r != n1){
+      // error from writei
+      break;
+    }
+    i += r;
+  }
+  return i == n ? n : -1;
+}
+
 // Write to file f.
 // addr is a user virtual address.
 int
 filewrite(struct file *f, uint64 addr, int n)
 {
-  int r, ret = 0;
+  int ret = 0;
 
   if(f->writable == 0)
     return -1;
@@ -162,33 +252,7 @@ filewrite(struct file *f, uint64 addr, int n)
       return -1;
     ret = devsw[f->major].write(1, addr, n);
   } else if(f->type == FD_INODE){
-    // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
-    // this really belongs lower down, since writei()
-    // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
-    int i = 0;
-    while(i < n){
-      int n1 = n - i;
-      if(n1 > max)
-        n1 = max;
-
-      begin_op();
-      ilock(f->ip);
-      if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
-        f->off += r;
-      iunlock(f->ip);
-      end_op();
-
-      if(r != n1){
-        // error from writei
-        break;
-      }
-      i += r;
-    }
-    ret = (i == n ? n : -1);
+    ret = iwrite(f->ip, 1, addr, &f->off, n);
   } else if(f->type == FD_SOCK){
     ret = sockwrite(f->sock, addr, n);
   } else {
@@ -198,3 +262,13 @@ filewrite(struct file *f, uint64 addr, int n)
   return ret;
 }
 
+// Write n bytes from kernel address src to f at offset
+// off, leaving f->off alone; for writing back pages of a
+// shared mapping. Returns n, or -1.
+int
+filewriteat(struct file *f, char *src, uint off, int n)
+{
+  if(f->writable == 0 || f->type != FD_INODE)
+    return -1;
+  return iwrite(f->ip, 0, (uint64)src, &off, n);
+}
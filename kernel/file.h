@@ -7,6 +7,9 @@ struct file {
   struct inode *ip;  // FD_INODE and FD_DEVICE
   struct sock *sock; // FD_SOCK
   uint off;          // FD_INODE
+  uint ranext;       // FD_INODE: offset a sequential read would start at
+  uint rablock;      // FD_INODE: read-ahead issued up to this block
+  uint rawin;        // FD_INODE: read-ahead window, in blocks
   short major;       // FD_DEVICE
 };
 
@@ -19,6 +22,11 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *hprev; // itable hash chain
+  struct inode *hnext;
+  struct inode *lprev; // itable LRU list, if ref is 0
+  struct inode *lnext;
+  int nexec;          // program segments mapping it; atomic; no writes while > 0
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
@@ -28,6 +36,12 @@ struct inode {
   short nlink;
   uint size;
   uint addrs[NDIRECT+2];
+  int extent;         // addrs[] holds an extent tree
+  struct extent ecur; // last extent bmap() used
+  uint dsize;         // size on disk; less than size until written back
+  uint dlo, dhi;      // blocks [dlo, dhi) may have dirty data
+  int wbq;            // on the write-back list?
+  struct inode *wbnext; // write-back list, protected by its lock
 };
 
 // map major device number to device functions.
@@ -26,6 +26,9 @@
 // only one device
 struct superblock sb; 
 
+static void aginit(int);
+static void wbinit(void);
+
 // Read the super block.
 static void
 readsb(int dev, struct superblock *sb)
@@ -44,6 +47,8 @@ fsinit(int dev) {
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
   initlog(dev, &sb);
+  aginit(dev);
+  wbinit();
 }
 
 // Zero a block.
@@ -52,46 +57,183 @@ bzero(int dev, int bno)
 {
   struct buf *bp;
 
-  bp = bread(dev, bno);
-  memset(bp->data, 0, BSIZE);
+  bp = bnew(dev, bno);
   log_write(bp);
   brelse(bp);
 }
 
 // Blocks.
+//
+// The blocks described by one bitmap block form an allocation
+// group. For each group, agroups keeps in memory the number of
+// free blocks and a hint, a bit at or below the group's first
+// free one, so that balloc() skips full groups and the full
+// start of a group without reading their bitmap blocks.
+// A group's counts change only with its bitmap block locked.
+//
+// File data is written in place, not through the log, so a
+// block freed by a transaction must not get new data until
+// that transaction has been installed: a crash before then
+// would leave the block's old owner pointing at the new
+// data. Each group has a busy bitmap of the blocks freed by
+// each of the last two transactions, which may still be
+// open and committing; ballocdata() skips them.
+
+struct {
+  struct spinlock lock;
+  int ngroup;
+  struct {
+    int nfree;
+    int hint;
+    uchar *busy[2];  // freed by a transaction with that tid%2
+  } g[(FSSIZE + BPB - 1) / BPB];
+} agroups;
+
+// Return the first clear bit of bitmap block data in
+// [from, to), or -1.
+static int
+bitscan(uchar *data, int from, int to)
+{
+  for(int bi = from; bi < to; bi++){
+    if(bi % 8 == 0 && bi + 8 <= to && data[bi/8] == 0xff){
+      bi += 7;  // skip a full byte
+      continue;
+    }
+    if((data[bi/8] & (1 << (bi % 8))) == 0)
+      return bi;
+  }
+  return -1;
+}
 
-// Allocate a zeroed disk block.
+// Number of blocks in group gi.
+static int
+agsize(int gi)
+{
+  return gi * BPB + BPB <= sb.size ? BPB : sb.size - gi * BPB;
+}
+
+// Count the free blocks in each group.
+static void
+aginit(int dev)
+{
+  struct buf *bp;
+  int gi, bi, n, k;
+  uchar *page = 0;
+
+  initlock(&agroups.lock, "agroups");
+  agroups.ngroup = (sb.size + BPB - 1) / BPB;
+  if(agroups.ngroup > NELEM(agroups.g))
+    panic("aginit: file system too big");
+  for(gi = 0; gi < agroups.ngroup; gi++){
+    for(int t = 0; t < 2; t++){
+      k = 2*gi + t;
+      if(k % (PGSIZE/(BPB/8)) == 0 && (page = kalloc()) == 0)
+        panic("aginit: busy");
+      agroups.g[gi].busy[t] = page + k % (PGSIZE/(BPB/8)) * (BPB/8);
+      memset(agroups.g[gi].busy[t], 0, BPB/8);
+    }
+    bp = bread(dev, BBLOCK(gi * BPB, sb));
+    n = agsize(gi);
+    agroups.g[gi].nfree = 0;
+    agroups.g[gi].hint = n;
+    for(bi = 0; bi < n; bi++){
+      if((bp->data[bi/8] & (1 << (bi % 8))) == 0){
+        if(agroups.g[gi].nfree++ == 0)
+          agroups.g[gi].hint = bi;
+      }
+    }
+    brelse(bp);
+  }
+}
+
+// Return the first bit in [from, to) that is clear in
+// group gi's bitmap block data and, if data is set, in its
+// busy bitmaps; or -1. Caller holds agroups.lock.
+static int
+freebit(uchar *map, int gi, int from, int to, int data)
+{
+  int bi;
+
+  while((bi = bitscan(map, from, to)) >= 0){
+    if(!data)
+      return bi;
+    if(((agroups.g[gi].busy[0][bi/8] | agroups.g[gi].busy[1][bi/8]) &
+        (1 << (bi % 8))) == 0)
+      return bi;
+    from = bi + 1;
+  }
+  return -1;
+}
+
+// Allocate a disk block: goal if it is free, else the nearest
+// free block after it in goal's group, else the first free
+// block of the next group with any. The block's contents are
+// not zeroed; see bzero() and bnew(). If data, the block will
+// be written in place, so skip blocks freed by transactions
+// that have not been installed.
 static uint
-balloc(uint dev)
+balloc1(uint dev, uint goal, int data)
 {
-  int b, bi, m;
+  int i, gi, g0, bi, n;
   struct buf *bp;
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
-      }
+  if(goal >= sb.size)
+    goal = 0;
+  g0 = goal / BPB;
+  for(i = 0; i < agroups.ngroup; i++){
+    gi = (g0 + i) % agroups.ngroup;
+    acquire(&agroups.lock);
+    n = agroups.g[gi].nfree;
+    release(&agroups.lock);
+    if(n == 0)
+      continue;
+
+    bp = bread(dev, BBLOCK(gi * BPB, sb));
+    n = agsize(gi);
+    bi = -1;
+    acquire(&agroups.lock);
+    if(gi == g0 && goal % BPB >= agroups.g[gi].hint)
+      bi = freebit(bp->data, gi, goal % BPB, n, data);
+    if(bi < 0)
+      bi = freebit(bp->data, gi, agroups.g[gi].hint, n, data);
+    if(bi >= 0){
+      bp->data[bi/8] |= 1 << (bi % 8);  // Mark block in use.
+      agroups.g[gi].nfree--;
+      if(bi == agroups.g[gi].hint)
+        agroups.g[gi].hint = bi + 1;
+    }
+    release(&agroups.lock);
+    if(bi >= 0){
+      log_write(bp);
+      brelse(bp);
+      return gi * BPB + bi;
     }
     brelse(bp);
   }
   panic("balloc: out of blocks");
 }
 
+static uint
+balloc(uint dev, uint goal)
+{
+  return balloc1(dev, goal, 0);
+}
+
+static uint
+ballocdata(uint dev, uint goal)
+{
+  return balloc1(dev, goal, 1);
+}
+
 // Free a disk block.
 static void
 bfree(int dev, uint b)
 {
   struct buf *bp;
-  int bi, m;
+  int bi, m, gi;
+  uint tid;
 
+  tid = logtid();
   bp = bread(dev, BBLOCK(b, sb));
   bi = b % BPB;
   m = 1 << (bi % 8);
@@ -99,9 +241,27 @@ bfree(int dev, uint b)
     panic("freeing free block");
   bp->data[bi/8] &= ~m;
   log_write(bp);
+  gi = b / BPB;
+  acquire(&agroups.lock);
+  agroups.g[gi].nfree++;
+  if(bi < agroups.g[gi].hint)
+    agroups.g[gi].hint = bi;
+  agroups.g[gi].busy[tid % 2][bi/8] |= m;
+  release(&agroups.lock);
   brelse(bp);
 }
 
+// Called by the log writer once transaction tid has been
+// installed: the blocks it freed may now get new data.
+void
+bcommitted(uint tid)
+{
+  acquire(&agroups.lock);
+  for(int gi = 0; gi < agroups.ngroup; gi++)
+    memset(agroups.g[gi].busy[tid % 2], 0, BPB/8);
+  release(&agroups.lock);
+}
+
 // Inodes.
 //
 // An inode describes a single unnamed file.
@@ -127,18 +287,19 @@ bfree(int dev, uint b)
 //   is non-zero. ialloc() allocates, and iput() frees if
 //   the reference and link counts have fallen to zero.
 //
-// * Referencing in table: an entry in the inode table
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
-//   the number of in-memory pointers to the entry (open
-//   files and current directories). iget() finds or
-//   creates a table entry and increments its ref; iput()
-//   decrements ref.
+// * Referencing in table: ip->ref tracks the number of
+//   in-memory pointers to the entry (open files and current
+//   directories). iget() finds or creates a table entry and
+//   increments its ref; iput() decrements ref. An entry
+//   whose ref has fallen to zero stays in the table, on an
+//   LRU list, until iget() recycles it for another inode.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   table entry is only correct when ip->valid is 1.
-//   ilock() reads the inode from
-//   the disk and sets ip->valid, while iput() clears
-//   ip->valid if ip->ref has fallen to zero.
+//   ilock() reads the inode from the disk and sets
+//   ip->valid, while iput() clears ip->valid when it frees
+//   the inode. An unreferenced entry stays valid, so a
+//   later iget() of the same inode needn't read it again.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
@@ -162,28 +323,95 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The itable.lock spin-lock protects the allocation of itable
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// The table is a hash table keyed by (dev, inum), whose
+// NIHASH chains are protected by NIBUCKET spin-locks: chain h
+// by lock h % NIBUCKET. One must hold the lock of an entry's
+// chain while using ip->ref. itable.lrulock protects the LRU
+// list of unreferenced entries, and itable.lock serializes
+// recycling, the only thing that changes an entry's ip->dev
+// and ip->inum, so two CPUs missing on the same inode cannot
+// both insert it. Lock order: itable.lock, chain lock, lrulock.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+#define NIBUCKET 13  // number of chain locks
+#define NIHASH 509   // number of hash chains; prime
+#define IHASH(dev, inum) ((((dev) << 16) ^ (inum)) % NIHASH)
+#define ILOCK(h) (&itable.bucket[(h) % NIBUCKET])
+
 struct {
-  struct spinlock lock;
+  struct spinlock lock;      // held while recycling an entry
+  struct spinlock bucket[NIBUCKET];
+  struct inode *hash[NIHASH];  // chains, through hprev/hnext
+  struct spinlock lrulock;
+  struct inode lru;          // unreferenced entries, least recent first
   struct inode inode[NINODE];
 } itable;
 
+static void
+ihash_insert(struct inode *ip)
+{
+  struct inode **chain = &itable.hash[IHASH(ip->dev, ip->inum)];
+
+  ip->hprev = 0;
+  ip->hnext = *chain;
+  if(*chain)
+    (*chain)->hprev = ip;
+  *chain = ip;
+}
+
+static void
+ihash_remove(struct inode *ip)
+{
+  if(ip->hprev)
+    ip->hprev->hnext = ip->hnext;
+  else
+    itable.hash[IHASH(ip->dev, ip->inum)] = ip->hnext;
+  if(ip->hnext)
+    ip->hnext->hprev = ip->hprev;
+  ip->hprev = ip->hnext = 0;
+}
+
+// Append ip to the LRU list, or take it off.
+// Caller holds itable.lrulock.
+static void
+lru_append(struct inode *ip)
+{
+  ip->lnext = &itable.lru;
+  ip->lprev = itable.lru.lprev;
+  itable.lru.lprev->lnext = ip;
+  itable.lru.lprev = ip;
+}
+
+static void
+lru_remove(struct inode *ip)
+{
+  ip->lprev->lnext = ip->lnext;
+  ip->lnext->lprev = ip->lprev;
+  ip->lprev = ip->lnext = 0;
+}
+
 void
 iinit()
 {
   int i = 0;
+  struct inode *ip;
   
   initlock(&itable.lock, "itable");
+  initlock(&itable.lrulock, "itable.lru");
+  for(i = 0; i < NIBUCKET; i++)
+    initlock(&itable.bucket[i], "itable.bucket");
+  itable.lru.lnext = itable.lru.lprev = &itable.lru;
+
+  // All entries start out unreferenced, holding inode 0
+  // of device 0, which no one looks up.
   for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
+    ip = &itable.inode[i];
+    initsleeplock(&ip->lock, "inode");
+    ihash_insert(ip);
+    lru_append(ip);
   }
 }
 
@@ -204,7 +432,7 @@ ialloc(uint dev, short type)
     dip = (struct dinode*)bp->data + inum%IPB;
     if(dip->type == 0){  // a free inode
       memset(dip, 0, sizeof(*dip));
-      dip->type = type;
+      dip->type = type | T_EXTENT;
       log_write(bp);   // mark it allocated on the disk
       brelse(bp);
       return iget(dev, inum);
@@ -227,46 +455,106 @@ iupdate(struct inode *ip)
   bp = bread(ip->dev, IBLOCK(ip->inum, sb));
   dip = (struct dinode*)bp->data + ip->inum%IPB;
   dip->type = ip->type;
+  if(ip->type && ip->extent)
+    dip->type |= T_EXTENT;
   dip->major = ip->major;
   dip->minor = ip->minor;
   dip->nlink = ip->nlink;
-  dip->size = ip->size;
+  dip->size = ip->dsize;
   memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
   log_write(bp);
   brelse(bp);
 }
 
+// Find the entry for (dev, inum) and take a reference.
+// Caller holds the chain's lock.
+static struct inode*
+ifind(uint dev, uint inum)
+{
+  struct inode *ip;
+
+  for(ip = itable.hash[IHASH(dev, inum)]; ip != 0; ip = ip->hnext){
+    if(ip->dev == dev && ip->inum == inum){
+      if(ip->ref == 0){
+        acquire(&itable.lrulock);
+        lru_remove(ip);
+        release(&itable.lrulock);
+      }
+      ip->ref++;
+      return ip;
+    }
+  }
+  return 0;
+}
+
+// Take the least recently used unreferenced entry out of
+// the table. Caller holds itable.lock.
+static struct inode*
+irecycle(void)
+{
+  struct inode *ip;
+  struct spinlock *lk;
+
+  for(;;){
+    acquire(&itable.lrulock);
+    ip = itable.lru.lnext;
+    release(&itable.lrulock);
+    if(ip == &itable.lru)
+      panic("iget: no inodes");
+
+    // ip->dev and ip->inum can't change, since we hold
+    // itable.lock, but ip may have been referenced since
+    // we looked; if so, try again.
+    lk = ILOCK(IHASH(ip->dev, ip->inum));
+    acquire(lk);
+    acquire(&itable.lrulock);
+    if(ip->ref == 0 && ip->lnext != 0){
+      lru_remove(ip);
+      release(&itable.lrulock);
+      ihash_remove(ip);
+      release(lk);
+      return ip;
+    }
+    release(&itable.lrulock);
+    release(lk);
+  }
+}
+
 // Find the inode with number inum on device dev
 // and return the in-memory copy. Does not lock
 // the inode and does not read it from disk.
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
-
-  acquire(&itable.lock);
+  struct inode *ip;
+  int h = IHASH(dev, inum);
 
   // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
-      release(&itable.lock);
-      return ip;
-    }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
+  acquire(ILOCK(h));
+  ip = ifind(dev, inum);
+  release(ILOCK(h));
+  if(ip)
+    return ip;
+
+  // Recycle an inode entry. Look again under itable.lock,
+  // since another CPU may have inserted the inode.
+  acquire(&itable.lock);
+  acquire(ILOCK(h));
+  ip = ifind(dev, inum);
+  release(ILOCK(h));
+  if(ip){
+    release(&itable.lock);
+    return ip;
   }
 
-  // Recycle an inode entry.
-  if(empty == 0)
-    panic("iget: no inodes");
-
-  ip = empty;
+  ip = irecycle();
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  acquire(ILOCK(h));
+  ihash_insert(ip);
+  release(ILOCK(h));
   release(&itable.lock);
 
   return ip;
@@ -277,9 +565,11 @@ iget(uint dev, uint inum)
 struct inode*
 idup(struct inode *ip)
 {
-  acquire(&itable.lock);
+  struct spinlock *lk = ILOCK(IHASH(ip->dev, ip->inum));
+
+  acquire(lk);
   ip->ref++;
-  release(&itable.lock);
+  release(lk);
   return ip;
 }
 
@@ -299,11 +589,14 @@ ilock(struct inode *ip)
   if(ip->valid == 0){
     bp = bread(ip->dev, IBLOCK(ip->inum, sb));
     dip = (struct dinode*)bp->data + ip->inum%IPB;
-    ip->type = dip->type;
+    ip->type = dip->type & ~T_EXTENT;
+    ip->extent = (dip->type & T_EXTENT) != 0;
+    ip->ecur.len = 0;
     ip->major = dip->major;
     ip->minor = dip->minor;
     ip->nlink = dip->nlink;
-    ip->size = dip->size;
+    ip->size = ip->dsize = dip->size;
+    ip->dlo = ip->dhi = 0;
     memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
     brelse(bp);
     ip->valid = 1;
@@ -324,7 +617,7 @@ iunlock(struct inode *ip)
 
 // Drop a reference to an in-memory inode.
 // If that was the last reference, the inode table entry can
-// be recycled.
+// be recycled, but it stays cached until it is.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -332,7 +625,9 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
-  acquire(&itable.lock);
+  struct spinlock *lk = ILOCK(IHASH(ip->dev, ip->inum));
+
+  acquire(lk);
 
   if(ip->ref == 1 && ip->valid && ip->nlink == 0){
     // inode has no links and no other references: truncate and free.
@@ -341,8 +636,10 @@ iput(struct inode *ip)
     // so this acquiresleep() won't block (or deadlock).
     acquiresleep(&ip->lock);
 
-    release(&itable.lock);
+    release(lk);
 
+    if(ip->type == T_DIR)
+      dcache_purge(ip->dev, ip->inum);
     itrunc(ip);
     ip->type = 0;
     iupdate(ip);
@@ -350,11 +647,17 @@ iput(struct inode *ip)
 
     releasesleep(&ip->lock);
 
-    acquire(&itable.lock);
+    acquire(lk);
   }
 
   ip->ref--;
-  release(&itable.lock);
+  if(ip->ref == 0){
+    // keep it cached until iget() needs the entry.
+    acquire(&itable.lrulock);
+    lru_append(ip);
+    release(&itable.lrulock);
+  }
+  release(lk);
 }
 
 // Common idiom: unlock, then put.
@@ -368,33 +671,230 @@ iunlockput(struct inode *ip)
 // Inode content
 //
 // The content (data) associated with each inode is stored
-// in blocks on the disk. The first NDIRECT block numbers
-// are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// in blocks on the disk. In an extent-mapped inode,
+// ip->addrs[] is the root of a tree of extents (see fs.h).
+// Otherwise the first NDIRECT block numbers are listed in
+// ip->addrs[], the next NINDIRECT blocks are listed in block
+// ip->addrs[NDIRECT], and the rest through the doubly
+// indirect block ip->addrs[NDIRECT+1].
+
+static struct extent*
+ents(struct extenthdr *h)
+{
+  return (struct extent*)(h + 1);
+}
+
+// Set *e to the extent of ip that maps the last block at or
+// before bn, or to an empty extent if ip has no blocks.
+static void
+elookup(struct inode *ip, uint bn, struct extent *e)
+{
+  struct extenthdr *h = (struct extenthdr*)ip->addrs;
+  struct buf *bp = 0;
+  int lo, hi, mid;
+
+  for(;;){
+    if(h->n == 0){
+      memset(e, 0, sizeof(*e));
+      break;
+    }
+    lo = 0;
+    hi = h->n - 1;
+    while(lo < hi){
+      mid = (lo + hi + 1) / 2;
+      if(ents(h)[mid].lbn <= bn)
+        lo = mid;
+      else
+        hi = mid - 1;
+    }
+    if(h->depth == 0){
+      *e = ents(h)[lo];
+      break;
+    }
+    uint child = ents(h)[lo].start;
+    if(bp)
+      brelse(bp);
+    bp = bread(ip->dev, child);
+    h = (struct extenthdr*)bp->data;
+  }
+  if(bp)
+    brelse(bp);
+}
+
+// Add disk block addr as file block lbn, the new last block
+// of ip: extend the last extent if addr follows it on disk,
+// else add an extent, splitting full nodes on the rightmost
+// path and deepening the tree if the root is full.
+static void
+eappend(struct inode *ip, uint lbn, uint addr)
+{
+  struct extenthdr *node[MAXEXTDEPTH+1], *h, *nh;
+  struct buf *path[MAXEXTDEPTH], *bp;
+  struct extent ent, *e;
+  int d, depth;
+  uint nb;
+
+  node[0] = h = (struct extenthdr*)ip->addrs;
+  depth = h->depth;
+  if(depth > MAXEXTDEPTH)
+    panic("eappend: depth");
+
+  // the rightmost path, from the root at node[depth] down
+  // to the leaf at node[0].
+  node[depth] = h;
+  for(d = depth; d > 0; d--){
+    e = &ents(node[d])[node[d]->n - 1];
+    path[d-1] = bread(ip->dev, e->start);
+    node[d-1] = (struct extenthdr*)path[d-1]->data;
+  }
+
+  h = node[0];
+  if(h->n > 0){
+    e = &ents(h)[h->n - 1];
+    if(e->start + e->len == addr && e->lbn + e->len == lbn){
+      e->len++;
+      ip->ecur = *e;
+      if(depth > 0)
+        log_write(path[0]);
+      goto out;
+    }
+  }
+
+  ent.lbn = lbn;
+  ent.start = addr;
+  ent.len = 1;
+  ip->ecur = ent;
+  for(d = 0; ; d++){
+    h = node[d];
+    if(d == depth){
+      // the root, in the inode.
+      if(h->n < NEXTROOT){
+        ents(h)[h->n++] = ent;
+        break;
+      }
+      // move the root's entries to a new node below it, which
+      // has room for ent.
+      if(depth == MAXEXTDEPTH)
+        panic("eappend: too deep");
+      nb = balloc(ip->dev, 0);
+      bp = bnew(ip->dev, nb);
+      nh = (struct extenthdr*)bp->data;
+      memmove(nh, h, sizeof(*h) + h->n * sizeof(struct extent));
+      ents(nh)[nh->n++] = ent;
+      log_write(bp);
+      brelse(bp);
+      h->depth = depth + 1;
+      h->n = 1;
+      ents(h)[0].lbn = 0;
+      ents(h)[0].start = nb;
+      ents(h)[0].len = 0;
+      break;
+    }
+    if(h->n < NEXTNODE){
+      ents(h)[h->n++] = ent;
+      log_write(path[d]);
+      break;
+    }
+    // node full: start its right sibling with ent, and add
+    // the sibling to the parent.
+    nb = balloc(ip->dev, 0);
+    bp = bnew(ip->dev, nb);
+    nh = (struct extenthdr*)bp->data;
+    nh->n = 1;
+    nh->depth = d;
+    ents(nh)[0] = ent;
+    log_write(bp);
+    brelse(bp);
+    ent.start = nb;
+    ent.len = 0;
+  }
+
+out:
+  for(d = 0; d < depth; d++)
+    brelse(path[d]);
+}
+
+// Return the disk block address of block bn of extent-mapped
+// inode ip. If bn is past the last block, allocate blocks up
+// to it, each placed right after the one before on disk if
+// that block is free.
+static uint
+emap(struct inode *ip, uint bn)
+{
+  struct extent e;
+  uint end;
+
+  e = ip->ecur;
+  if(bn - e.lbn < e.len)
+    return e.start + bn - e.lbn;
+
+  elookup(ip, bn, &e);
+  if(bn - e.lbn < e.len){
+    ip->ecur = e;
+    return e.start + bn - e.lbn;
+  }
+
+  for(end = e.lbn + e.len; end <= bn; end++){
+    eappend(ip, end, ballocdata(ip->dev, e.len ? e.start + e.len : 0));
+    e = ip->ecur;
+    if(end < bn)
+      bzero(ip->dev, e.start + e.len - 1);
+  }
+  return e.start + bn - e.lbn;
+}
+
+// Free the blocks mapped by the extent tree node h, and its
+// children.
+static void
+efree(uint dev, struct extenthdr *h)
+{
+  struct extent *e;
+  struct buf *bp;
+
+  for(int i = 0; i < h->n; i++){
+    e = &ents(h)[i];
+    if(h->depth == 0){
+      for(uint j = 0; j < e->len; j++)
+        bfree(dev, e->start + j);
+    } else {
+      bp = bread(dev, e->start);
+      efree(dev, (struct extenthdr*)bp->data);
+      brelse(bp);
+      bfree(dev, e->start);
+    }
+  }
+}
 
 // Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
+// If there is no such block, bmap allocates one; its contents
+// are whatever was on the disk, so the caller must fill it,
+// as writei() does.
 static uint
 bmap(struct inode *ip, uint bn)
 {
   uint addr, *a;
   struct buf *bp;
 
+  if(ip->extent)
+    return emap(ip, bn);
+
   if(bn < NDIRECT){
     if((addr = ip->addrs[bn]) == 0)
-      ip->addrs[bn] = addr = balloc(ip->dev);
+      ip->addrs[bn] = addr = balloc(ip->dev, 0);
     return addr;
   }
   bn -= NDIRECT;
 
   if(bn < NINDIRECT){
     // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT]) == 0)
-      ip->addrs[NDIRECT] = addr = balloc(ip->dev);
+    if((addr = ip->addrs[NDIRECT]) == 0){
+      ip->addrs[NDIRECT] = addr = balloc(ip->dev, 0);
+      bzero(ip->dev, addr);
+    }
     bp = bread(ip->dev, addr);
     a = (uint*)bp->data;
     if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
+      a[bn] = addr = balloc(ip->dev, 0);
       log_write(bp);
     }
     brelse(bp);
@@ -404,16 +904,19 @@ bmap(struct inode *ip, uint bn)
 
   if(bn < NDBINDIRECT){
     // Load doubly indirect block, allocating if necessary
-    if((addr = ip->addrs[NDIRECT+1]) == 0)
-      ip->addrs[NDIRECT+1] = addr = balloc(ip->dev);
+    if((addr = ip->addrs[NDIRECT+1]) == 0){
+      ip->addrs[NDIRECT+1] = addr = balloc(ip->dev, 0);
+      bzero(ip->dev, addr);
+    }
     bp = bread(ip->dev, addr);
     a = (uint*)bp->data;
 
     // Load singly indirect block
     uint en = bn / NINDIRECT;
     if((addr = a[en]) == 0){
-      a[en] = addr = balloc(ip->dev);
+      a[en] = addr = balloc(ip->dev, 0);
       log_write(bp);
+      bzero(ip->dev, addr);
     }
     brelse(bp); 
     bp = bread(ip->dev, addr);
@@ -421,7 +924,7 @@ bmap(struct inode *ip, uint bn)
 
     // retrieve target block address
     if((addr = a[bn % NINDIRECT]) == 0){
-      a[bn % NINDIRECT] = addr = balloc(ip->dev);
+      a[bn % NINDIRECT] = addr = balloc(ip->dev, 0);
       log_write(bp);
     }
     brelse(bp);
@@ -431,6 +934,282 @@ bmap(struct inode *ip, uint bn)
   panic("bmap: out of range");
 }
 
+// Write-back.
+//
+// Writes to regular files don't go through the log. writei()
+// leaves the data dirty in the buffer cache, pinned there,
+// and the flusher thread writes it back later. Blocks past
+// the end of the file's extents are not allocated by
+// writei(): their data waits in bufs keyed by DELAYDEV(ip)
+// and the block's place in the file, so the flusher can
+// allocate all of a file's new blocks at once, in one run
+// if the disk has room. The flusher writes the data in place
+// and waits for it before ending the transaction that records
+// the blocks and the new size (ordered data), so after a
+// crash a file never has blocks or a size whose data was not
+// written. Until then the on-disk size, ip->dsize, lags
+// ip->size.
+
+#define FLUSHTICKS 10  // max ticks file data stays dirty
+#define FLUSHMAX   128 // max blocks the flusher allocates per transaction
+#define WBRUN      32  // max blocks the flusher writes at once
+
+#define DELAYDEV(ip) (0x80000000 | (ip)->dev << 24 | (ip)->inum)
+
+struct {
+  struct spinlock lock;
+  struct inode *list;  // inodes with dirty data; each holds a ref
+  int ndirty;          // dirty bufs, including delayed ones
+  uint since;          // ticks when list became non-empty
+} wb;
+
+// Do writes to ip use write-back?
+// Caller holds ip->lock, or has ip open.
+int
+iwriteback(struct inode *ip)
+{
+  return ip->type == T_FILE && ip->extent;
+}
+
+// Number of blocks of ip that have disk blocks.
+static uint
+iblocks(struct inode *ip)
+{
+  struct extent e;
+
+  if(!ip->extent)
+    return (ip->size + BSIZE - 1) / BSIZE;
+  elookup(ip, ~0U, &e);
+  return e.lbn + e.len;
+}
+
+// Return the locked buf holding delayed block lbn of ip:
+// its dirty data, or zeros if it has none yet.
+static struct buf*
+dbuf(struct inode *ip, uint lbn)
+{
+  struct buf *b;
+
+  if((b = bfind(DELAYDEV(ip), lbn)) != 0){
+    if(b->dirty)
+      return b;
+    brelse(b);
+  }
+  return bnew(DELAYDEV(ip), lbn);
+}
+
+// Record that b, block lbn of ip, holds dirty data, and
+// put ip on the write-back list if it isn't there.
+static void
+wbmark(struct inode *ip, uint lbn, struct buf *b)
+{
+  int first = bdirty(b);
+
+  if(ip->dlo == ip->dhi){
+    ip->dlo = lbn;
+    ip->dhi = lbn + 1;
+  } else if(lbn < ip->dlo){
+    ip->dlo = lbn;
+  } else if(lbn >= ip->dhi){
+    ip->dhi = lbn + 1;
+  }
+  if(!ip->wbq)
+    idup(ip);
+  acquire(&wb.lock);
+  wb.ndirty += first;
+  if(!ip->wbq){
+    ip->wbq = 1;
+    if(wb.list == 0)
+      wb.since = ticks;
+    ip->wbnext = wb.list;
+    wb.list = ip;
+  }
+  release(&wb.lock);
+}
+
+// b is no longer dirty.
+static void
+wbclean(struct buf *b)
+{
+  if(bclean(b)){
+    acquire(&wb.lock);
+    wb.ndirty--;
+    wakeup(&wb.ndirty);
+    release(&wb.lock);
+  }
+}
+
+// Write bufs b[0..n) and wait for them, as runs of
+// consecutive blocks; then release them.
+static void
+wbwrite(struct buf **b, int n)
+{
+  int i, run;
+
+  for(i = 0; i < n; i += run){
+    for(run = 1; i + run < n && b[i+run]->blockno == b[i]->blockno + run; run++)
+      ;
+    bwritev_async(&b[i], run);
+  }
+  for(i = 0; i < n; i++){
+    bwait(b[i]);
+    brelse(b[i]);
+  }
+}
+
+// Write back ip's dirty data, allocating blocks for at
+// most FLUSHMAX delayed ones, and record the new size.
+// Returns 1 if some data is still dirty.
+// Caller holds ip->lock, in a transaction.
+static int
+iflush(struct inode *ip)
+{
+  struct buf *run[WBRUN], *b, *d;
+  uint lbn, nalloc, end;
+  int n = 0;
+
+  nalloc = iblocks(ip);
+  end = ip->dhi;
+  if(end > nalloc + FLUSHMAX)
+    end = nalloc + FLUSHMAX;
+  for(lbn = ip->dlo; lbn < end; lbn++){
+    if(lbn < nalloc){
+      if((b = bfind(ip->dev, bmap(ip, lbn))) == 0)
+        continue;
+      if(!b->dirty){
+        brelse(b);
+        continue;
+      }
+      wbclean(b);
+    } else {
+      // bmap() allocates the block, right after the last.
+      if((d = bfind(DELAYDEV(ip), lbn)) == 0 || !d->dirty)
+        panic("iflush");
+      b = bnew(ip->dev, bmap(ip, lbn));
+      memmove(b->data, d->data, BSIZE);
+      wbclean(d);
+      d->valid = 0;
+      brelse(d);
+    }
+    run[n++] = b;
+    if(n == WBRUN){
+      wbwrite(run, n);
+      n = 0;
+    }
+  }
+  wbwrite(run, n);
+
+  ip->dlo = end;
+  if(ip->dlo >= ip->dhi)
+    ip->dlo = ip->dhi = 0;
+  ip->dsize = ip->size;
+  if(ip->dsize > iblocks(ip) * BSIZE)
+    ip->dsize = iblocks(ip) * BSIZE;
+  iupdate(ip);
+  return ip->dhi > ip->dlo;
+}
+
+// Drop ip's dirty data, which is being truncated away.
+// Caller holds ip->lock.
+static void
+wbdiscard(struct inode *ip)
+{
+  struct buf *b;
+  uint lbn, nalloc;
+
+  nalloc = iblocks(ip);
+  for(lbn = ip->dlo; lbn < ip->dhi; lbn++){
+    if(lbn < nalloc)
+      b = bfind(ip->dev, bmap(ip, lbn));
+    else
+      b = bfind(DELAYDEV(ip), lbn);
+    if(b){
+      wbclean(b);
+      if(lbn >= nalloc)
+        b->valid = 0;
+      brelse(b);
+    }
+  }
+  ip->dlo = ip->dhi = 0;
+}
+
+// The flusher thread. Once data has been dirty for
+// FLUSHTICKS, or there is a lot of it, it writes back every
+// inode on the list, one transaction at a time.
+static void
+flusher(void)
+{
+  struct inode *ip;
+  int more, flushing = 0;
+
+  acquire(&wb.lock);
+  for(;;){
+    while(wb.list == 0 ||
+          !(flushing || wb.ndirty >= NDIRTY/2 || ticks - wb.since >= FLUSHTICKS))
+      sleep(&ticks, &wb.lock);
+    flushing = 1;
+    ip = wb.list;
+    wb.list = ip->wbnext;
+    release(&wb.lock);
+
+    begin_op();
+    ilock(ip);
+    more = iflush(ip);
+    if(!more)
+      ip->wbq = 0;
+    iunlock(ip);
+    if(!more)
+      iput(ip);
+    end_op();
+
+    acquire(&wb.lock);
+    if(more){
+      ip->wbnext = wb.list;
+      wb.list = ip;
+    }
+    if(wb.list == 0)
+      flushing = 0;
+  }
+}
+
+// Write back all of ip's dirty data now, and wait until it
+// and the transactions recording it are on disk.
+void
+isync(struct inode *ip)
+{
+  int more;
+
+  do {
+    begin_op();
+    ilock(ip);
+    more = iflush(ip);
+    iunlock(ip);
+    end_op();
+  } while(more);
+  logsync();
+}
+
+// Called by a writer between transactions: wait while too
+// much data is dirty for the flusher to keep up.
+void
+wbthrottle(void)
+{
+  acquire(&wb.lock);
+  while(wb.ndirty >= NDIRTY){
+    wakeup(&ticks);
+    sleep(&wb.ndirty, &wb.lock);
+  }
+  release(&wb.lock);
+}
+
+static void
+wbinit(void)
+{
+  initlock(&wb.lock, "writeback");
+  if(kthread_create("flusher", flusher) < 0)
+    panic("wbinit: flusher");
+}
+
 // Truncate inode (discard contents).
 // Caller must hold ip->lock.
 void
@@ -440,6 +1219,18 @@ itrunc(struct inode *ip)
   struct buf *bp;
   uint *a;
 
+  pcache_inval(ip->dev, ip->inum);
+
+  if(ip->extent){
+    wbdiscard(ip);
+    efree(ip->dev, (struct extenthdr*)ip->addrs);
+    memset(ip->addrs, 0, sizeof(ip->addrs));
+    ip->ecur.len = 0;
+    ip->size = ip->dsize = 0;
+    iupdate(ip);
+    return;
+  }
+
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
       bfree(ip->dev, ip->addrs[i]);
@@ -482,7 +1273,10 @@ itrunc(struct inode *ip)
     ip->addrs[NDIRECT+1] = 0;
   }
 
-  ip->size = 0;
+  // addrs[] is now all zero, an empty extent tree.
+  ip->extent = 1;
+  ip->ecur.len = 0;
+  ip->size = ip->dsize = 0;
   iupdate(ip);
 }
 
@@ -498,15 +1292,73 @@ stati(struct inode *ip, struct stat *st)
   st->size = ip->size;
 }
 
+// Read data from inode's blocks, bypassing the page cache.
+// Caller must hold ip->lock.
+static int
+readblocks(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
+{
+  uint tot, m, nalloc;
+  struct buf *bp;
+
+  if(off > ip->size || off + n < off)
+    return 0;
+  if(off + n > ip->size)
+    n = ip->size - off;
+
+  // start all the blocks of a multi-block read at once.
+  if(n > 0 && (off + n - 1) / BSIZE > off / BSIZE)
+    ireadahead(ip, off / BSIZE, (off + n - 1) / BSIZE - off / BSIZE + 1);
+
+  nalloc = iblocks(ip);
+  for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
+    if(off/BSIZE < nalloc)
+      bp = bread(ip->dev, bmap(ip, off/BSIZE));
+    else if((bp = bfind(DELAYDEV(ip), off/BSIZE)) == 0 || !bp->dirty)
+      panic("readi: delayed block");
+    m = min(n - tot, BSIZE - off%BSIZE);
+    if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
+      brelse(bp);
+      tot = -1;
+      break;
+    }
+    brelse(bp);
+  }
+  return tot;
+}
+
+// Return page pgno of a regular file, from the page cache
+// or read from its blocks and cached, with a reference for
+// the caller to drop with kfree(). Returns 0 if out of
+// memory. Caller must hold ip->lock.
+char*
+igetpage(struct inode *ip, uint pgno)
+{
+  char *pa;
+  int n;
+
+  if((pa = pcache_lookup(ip->dev, ip->inum, pgno)) != 0)
+    return pa;
+  if((pa = kalloc()) == 0)
+    return 0;
+  n = readblocks(ip, 0, (uint64)pa, pgno*PGSIZE, PGSIZE);
+  memset(pa + n, 0, PGSIZE - n);
+  pcache_insert(ip->dev, ip->inum, pgno, pa);
+  return pa;
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
 // otherwise, dst is a kernel address.
+// Regular files are read through the page cache.
 int
 readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 {
   uint tot, m;
-  struct buf *bp;
+  char *pa;
+
+  if(ip->type != T_FILE)
+    return readblocks(ip, user_dst, dst, off, n);
 
   if(off > ip->size || off + n < off)
     return 0;
@@ -514,18 +1366,52 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     n = ip->size - off;
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
-    m = min(n - tot, BSIZE - off%BSIZE);
-    if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
-      brelse(bp);
+    m = min(n - tot, PGSIZE - off%PGSIZE);
+    if((pa = igetpage(ip, off/PGSIZE)) == 0){
+      // no memory for a page: read the blocks directly.
+      if((m = readblocks(ip, user_dst, dst, off, m)) == -1)
+        return -1;
+      continue;
+    }
+    if(either_copyout(user_dst, dst, pa + (off % PGSIZE), m) == -1) {
+      kfree(pa);
       tot = -1;
       break;
     }
-    brelse(bp);
+    kfree(pa);
   }
   return tot;
 }
 
+// Start reading up to n blocks of ip, from block bn on,
+// into the buffer cache without waiting for them. Blocks
+// that are contiguous on disk are read with one request.
+// Stops at the end of the file or when the disk queue is full.
+// Returns the number of blocks now cached or on their way.
+// Caller must hold ip->lock.
+uint
+ireadahead(struct inode *ip, uint bn, uint n)
+{
+  uint i, k, got, addr, nblock;
+
+  nblock = iblocks(ip);  // delayed blocks are already cached
+  if(bn >= nblock)
+    n = 0;
+  else if(n > nblock - bn)
+    n = nblock - bn;
+  for(i = 0; i < n; i += k){
+    addr = bmap(ip, bn + i);
+    for(k = 1; i + k < n && k < RAMAX && bmap(ip, bn + i + k) == addr + k; k++)
+      ;
+    if((got = bprefetch(ip->dev, addr, k)) < k){
+      i += got;
+      break;
+    }
+  }
+  bkick();
+  return i;
+}
+
 // Write data to inode.
 // Caller must hold ip->lock.
 // If user_src==1, then src is a user virtual address;
@@ -536,28 +1422,49 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 int
 writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 {
-  uint tot, m;
+  uint tot, m, lbn, nalloc;
   struct buf *bp;
+  int wbmode;
 
   if(off > ip->size || off + n < off)
     return -1;
   if(off + n > MAXFILE*BSIZE)
     return -1;
 
+  wbmode = iwriteback(ip);
+  nalloc = wbmode ? iblocks(ip) : 0;
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
+    lbn = off/BSIZE;
+    if(wbmode && lbn >= nalloc)
+      bp = dbuf(ip, lbn);
+    else if(!wbmode && off >= ip->size && off % BSIZE == 0)
+      // a block past the end of the file is new: start it from
+      // zeros rather than its old contents on disk.
+      bp = bnew(ip->dev, bmap(ip, lbn));
+    else
+      bp = bread(ip->dev, bmap(ip, lbn));
     m = min(n - tot, BSIZE - off%BSIZE);
     if(either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1) {
       brelse(bp);
       break;
     }
-    log_write(bp);
+    if(ip->type == T_FILE)
+      pcache_update(ip->dev, ip->inum, off, (char*)bp->data + (off % BSIZE), m);
+    if(wbmode)
+      wbmark(ip, lbn, bp);
+    else
+      log_write(bp);
     brelse(bp);
   }
 
   if(off > ip->size)
     ip->size = off;
 
+  // the flusher will write the data and the new size.
+  if(wbmode)
+    return tot;
+  ip->dsize = ip->size;
+
   // write the i-node back to disk even if the size didn't change
   // because the loop above might have called bmap() and added a new
   // block to ip->addrs[].
@@ -574,18 +1481,232 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+static int
+isdot(char *name)
+{
+  return namecmp(name, ".") == 0 || namecmp(name, "..") == 0;
+}
+
+// FNV-1a hash of a directory entry name.
+static uint
+dirhash(char *name)
+{
+  uint h = 2166136261;
+
+  for(int i = 0; i < DIRSIZ && name[i]; i++){
+    h ^= (uchar)name[i];
+    h *= 16777619;
+  }
+  return h;
+}
+
+// Return the global depth of hashed directory dp,
+// or -1 if dp is a linear directory.
+static int
+dirdepth(struct inode *dp)
+{
+  struct dirhdr h;
+
+  if(dp->size < DIRIDXOFF + DIRNIDX*BSIZE)
+    return -1;
+  if(readi(dp, 0, (uint64)&h, DIRHDROFF, sizeof(h)) != sizeof(h))
+    panic("dirdepth");
+  if(h.zero != 0 || h.magic != DIRHMAGIC)
+    return -1;
+  return h.depth;
+}
+
+static void
+dirsetdepth(struct inode *dp, int depth)
+{
+  struct dirhdr h;
+
+  memset(&h, 0, sizeof(h));
+  h.magic = DIRHMAGIC;
+  h.depth = depth;
+  if(writei(dp, 0, (uint64)&h, DIRHDROFF, sizeof(h)) != sizeof(h))
+    panic("dirsetdepth");
+}
+
+// Return the block number within dp of the bucket for hash.
+static uint
+dirbucket(struct inode *dp, int depth, uint hash)
+{
+  uint i, off;
+  ushort bn;
+
+  i = hash & ((1 << depth) - 1);
+  off = DIRIDXOFF + (i / DIRPTRS) * sizeof(struct dirindex) +
+    sizeof(ushort) + (i % DIRPTRS) * sizeof(ushort);
+  if(readi(dp, 0, (uint64)&bn, off, sizeof(bn)) != sizeof(bn))
+    panic("dirbucket");
+  return bn;
+}
+
+static ushort*
+idxslot(struct dirindex *idx, uint i)
+{
+  return &idx[i / DIRPTRS].bn[i % DIRPTRS];
+}
+
+// Convert the linear, one-block directory dp to a hashed
+// directory with two buckets. Returns 0 on success, -1 if
+// dp is left linear. Caller must hold dp->lock, inside a
+// transaction.
+static int
+dirconvert(struct inode *dp)
+{
+  char *page, *b;
+  struct dirent *ents, *bucket;
+  struct dirhdr *h;
+  int i, j, n;
+
+  if((page = kalloc()) == 0)
+    return -1;
+  if(readi(dp, 0, (uint64)page, 0, BSIZE) != BSIZE)
+    panic("dirconvert read");
+  ents = (struct dirent*)page;
+  if(namecmp(ents[0].name, ".") != 0 || namecmp(ents[1].name, "..") != 0){
+    kfree(page);
+    return -1;
+  }
+  b = page + BSIZE;
+
+  // block 0: ".", ".." and the header.
+  memset(b, 0, BSIZE);
+  memmove(b, ents, 2*sizeof(struct dirent));
+  h = (struct dirhdr*)(b + DIRHDROFF);
+  h->magic = DIRHMAGIC;
+  h->depth = 1;
+  if(writei(dp, 0, (uint64)b, 0, BSIZE) != BSIZE)
+    panic("dirconvert");
+
+  // the index, pointing at the two buckets that follow it.
+  memset(b, 0, BSIZE);
+  *idxslot((struct dirindex*)b, 0) = 1 + DIRNIDX;
+  *idxslot((struct dirindex*)b, 1) = 2 + DIRNIDX;
+  for(i = 0; i < DIRNIDX; i++){
+    if(writei(dp, 0, (uint64)b, DIRIDXOFF + i*BSIZE, BSIZE) != BSIZE)
+      panic("dirconvert");
+    memset(b, 0, BSIZE);
+  }
+
+  // the buckets.
+  for(j = 0; j < 2; j++){
+    memset(b, 0, BSIZE);
+    h = (struct dirhdr*)b;
+    h->magic = DIRBMAGIC;
+    h->depth = 1;
+    bucket = (struct dirent*)b;
+    n = 1;
+    for(i = 2; i < BSIZE / sizeof(struct dirent); i++)
+      if(ents[i].inum != 0 && (dirhash(ents[i].name) & 1) == j)
+        bucket[n++] = ents[i];
+    if(writei(dp, 0, (uint64)b, (1 + DIRNIDX + j) * BSIZE, BSIZE) != BSIZE)
+      panic("dirconvert");
+  }
+
+  // every entry has moved.
+  dcache_purge(dp->dev, dp->inum);
+  kfree(page);
+  return 0;
+}
+
+// Split the full bucket bn of hashed directory dp, whose
+// global depth is depth, doubling the index if needed.
+// page is a scratch page. Returns -1 if the index is
+// already as large as it can be.
+static int
+dirsplit(struct inode *dp, int depth, uint bn, char *page)
+{
+  struct dirent *old, *new;
+  struct dirindex *idx;
+  struct dirhdr *h;
+  int i, n, ld;
+  uint nbn;
+
+  old = (struct dirent*)page;
+  new = (struct dirent*)(page + BSIZE);
+  if(readi(dp, 0, (uint64)old, bn*BSIZE, BSIZE) != BSIZE)
+    panic("dirsplit read");
+  ld = ((struct dirhdr*)old)->depth;
+  if(ld == depth && depth == DIRMAXDEPTH)
+    return -1;
+
+  // move the entries whose bit ld is set to a new bucket,
+  // appended to the directory.
+  nbn = dp->size / BSIZE;
+  memset(new, 0, BSIZE);
+  h = (struct dirhdr*)new;
+  h->magic = DIRBMAGIC;
+  h->depth = ld + 1;
+  ((struct dirhdr*)old)->depth = ld + 1;
+  n = 1;
+  for(i = 1; i < BSIZE / sizeof(struct dirent); i++){
+    if(old[i].inum != 0 && (dirhash(old[i].name) >> ld) & 1){
+      new[n++] = old[i];
+      memset(&old[i], 0, sizeof(old[i]));
+    }
+  }
+  if(writei(dp, 0, (uint64)new, nbn*BSIZE, BSIZE) != BSIZE)
+    return -1;
+  if(writei(dp, 0, (uint64)old, bn*BSIZE, BSIZE) != BSIZE)
+    panic("dirsplit");
+  for(i = 1; i < n; i++)
+    dcache_enter(dp->dev, dp->inum, new[i].name, new[i].inum,
+                 nbn*BSIZE + i*sizeof(struct dirent));
+
+  // point the index slots of the moved half at the new bucket.
+  idx = (struct dirindex*)page;
+  if(readi(dp, 0, (uint64)idx, DIRIDXOFF, DIRNIDX*BSIZE) != DIRNIDX*BSIZE)
+    panic("dirsplit read");
+  if(ld == depth){
+    for(i = 0; i < (1 << depth); i++)
+      *idxslot(idx, i + (1 << depth)) = *idxslot(idx, i);
+    depth++;
+    dirsetdepth(dp, depth);
+  }
+  for(i = 0; i < (1 << depth); i++)
+    if(*idxslot(idx, i) == bn && (i >> ld) & 1)
+      *idxslot(idx, i) = nbn;
+  n = ((1 << depth) + DIRPTRS - 1) / DIRPTRS * sizeof(struct dirindex);
+  if(writei(dp, 0, (uint64)idx, DIRIDXOFF, n) != n)
+    panic("dirsplit");
+  return 0;
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
+// Caller must hold dp->lock.
 struct inode*
 dirlookup(struct inode *dp, char *name, uint *poff)
 {
-  uint off, inum;
+  uint off, end, inum, bn;
+  int depth;
   struct dirent de;
 
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
-  for(off = 0; off < dp->size; off += sizeof(de)){
+  if(dcache_lookup(dp->dev, dp->inum, name, &inum, &off)){
+    if(inum == 0)
+      return 0;
+    if(poff)
+      *poff = off;
+    return iget(dp->dev, inum);
+  }
+
+  // scan the whole of a linear directory, but only the
+  // name's bucket of a hashed one.
+  off = 0;
+  end = dp->size;
+  if(!isdot(name) && (depth = dirdepth(dp)) >= 0){
+    bn = dirbucket(dp, depth, dirhash(name));
+    off = bn*BSIZE + sizeof(de);
+    end = (bn+1)*BSIZE;
+  }
+
+  for(; off < end; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("dirlookup read");
     if(de.inum == 0)
@@ -595,13 +1716,50 @@ dirlookup(struct inode *dp, char *name, uint *poff)
       if(poff)
         *poff = off;
       inum = de.inum;
+      dcache_enter(dp->dev, dp->inum, name, inum, off);
       return iget(dp->dev, inum);
     }
   }
 
+  dcache_enter(dp->dev, dp->inum, name, 0, 0);
   return 0;
 }
 
+// Find an empty dirent for name in hashed directory dp,
+// splitting its bucket until it has one: if all its entries
+// hash to the same half, a split frees nothing. Returns the
+// offset, or -1 if the directory cannot grow. The caller's
+// operation must have reserved CREATEOPBLOCKS of log.
+static int
+dirslot(struct inode *dp, char *name)
+{
+  uint off, bn, h;
+  int depth;
+  char *page = 0;
+  struct dirent de;
+
+  h = dirhash(name);
+  for(;;){
+    depth = dirdepth(dp);
+    bn = dirbucket(dp, depth, h);
+    for(off = bn*BSIZE + sizeof(de); off < (bn+1)*BSIZE; off += sizeof(de)){
+      if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+        panic("dirslot read");
+      if(de.inum == 0){
+        if(page)
+          kfree(page);
+        return off;
+      }
+    }
+    if(page == 0 && (page = kalloc()) == 0)
+      return -1;
+    if(dirsplit(dp, depth, bn, page) < 0)
+      break;
+  }
+  kfree(page);
+  return -1;
+}
+
 // Write a new directory entry (name, inum) into the directory dp.
 int
 dirlink(struct inode *dp, char *name, uint inum)
@@ -616,18 +1774,28 @@ dirlink(struct inode *dp, char *name, uint inum)
     return -1;
   }
 
-  // Look for an empty dirent.
-  for(off = 0; off < dp->size; off += sizeof(de)){
-    if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
-      panic("dirlink read");
-    if(de.inum == 0)
-      break;
+  if(dirdepth(dp) < 0){
+    // Look for an empty dirent.
+    for(off = 0; off < dp->size; off += sizeof(de)){
+      if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
+        panic("dirlink read");
+      if(de.inum == 0)
+        break;
+    }
+    // Hash the directory rather than grow it past one block.
+    if(off == BSIZE && dp->size == BSIZE && dirconvert(dp) == 0)
+      off = dirslot(dp, name);
+  } else {
+    off = dirslot(dp, name);
   }
+  if(off < 0)
+    return -1;
 
   strncpy(de.name, name, DIRSIZ);
   de.inum = inum;
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("dirlink");
+  dcache_enter(dp->dev, dp->inum, name, inum, off);
 
   return 0;
 }
@@ -39,6 +39,31 @@ struct dinode {
   uint addrs[NDIRECT+2];   // Data block addresses
 };
 
+// Inodes allocated by this kernel carry T_EXTENT in their type
+// and use addrs[] as the root of an extent tree instead of a
+// block list. A leaf's entries are extents: runs of blocks
+// contiguous both in the file and on disk. An index node's
+// entries point to child nodes, one block each, and give the
+// first file block each child maps. Files only grow at the
+// end, so the tree is filled from the left and only ever
+// changes along its rightmost path.
+#define T_EXTENT 0x100
+
+struct extent {
+  uint lbn;    // first file block mapped
+  uint start;  // first disk block, or the child node's block
+  uint len;    // number of blocks; 0 in an index node
+};
+
+struct extenthdr {
+  ushort n;      // entries in use
+  ushort depth;  // 0 if the entries are extents
+};
+
+#define NEXTROOT ((sizeof(uint)*(NDIRECT+2) - sizeof(struct extenthdr)) / sizeof(struct extent))
+#define NEXTNODE ((BSIZE - sizeof(struct extenthdr)) / sizeof(struct extent))
+#define MAXEXTDEPTH 4
+
 // Inodes per block.
 #define IPB           (BSIZE / sizeof(struct dinode))
 
@@ -59,3 +84,45 @@ struct dirent {
   char name[DIRSIZ];
 };
 
+// A directory that outgrows its first block is converted to a
+// hashed directory, an extendible hash table of entries:
+//
+// [ block 0: ".", "..", header | index blocks | buckets ]
+//
+// The header records the global depth d of the index, an array
+// of 2^d bucket block numbers, indexed by the low d bits of the
+// hash of a name. Each bucket is one block whose first slot is
+// a header giving its local depth; the other slots hold the
+// entries. A full bucket is split in two, doubling the index
+// first if its local depth is already d.
+//
+// Headers and index slots all have inum 0, so a program that
+// reads a directory as a sequence of dirents, such as ls,
+// takes them for free entries.
+#define DIRHMAGIC   0x6864  // header of a hashed directory
+#define DIRBMAGIC   0x6862  // header of a bucket
+#define DIRMAXDEPTH 10      // maximum global depth
+#define DIRNIDX     3       // number of index blocks
+#define DIRPTRS     7       // bucket numbers per index slot
+#define DIRHDROFF   (2*sizeof(struct dirent))  // offset of the header
+#define DIRIDXOFF   BSIZE   // offset of the index
+
+// Log blocks for a system call that adds a directory entry.
+// dirlink() may split a bucket up to DIRMAXDEPTH-1 times
+// when its entries all hash to the same half; each split
+// after the first writes a new bucket, and may dirty another
+// bitmap block and extent block.
+#define CREATEOPBLOCKS (MAXOPBLOCKS + 3*(DIRMAXDEPTH-1))
+
+struct dirhdr {
+  ushort zero;         // always 0
+  ushort magic;        // DIRHMAGIC or DIRBMAGIC
+  ushort depth;        // global or local depth
+  ushort pad[5];
+};
+
+struct dirindex {
+  ushort zero;         // always 0
+  ushort bn[DIRPTRS];  // bucket block numbers within the directory
+};
+
@@ -1,6 +1,31 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
-// and pipe buffers. Allocates whole 4096-byte pages.
+// and pipe buffers. Allocates whole 4096-byte pages,
+// or, with allocpages(), blocks of 2^order contiguous pages.
+//
+// Free memory is kept by a buddy allocator: a free list
+// for each order 0..MAXORDER of blocks of 2^order pages,
+// each aligned to its own size. A request is served from
+// the smallest free block that is big enough, split in
+// halves as needed; a block being freed is merged with its
+// buddy, the other half of the block they were split from,
+// whenever that is free too, and so on up.
+//
+// In front of it, each CPU keeps a list of free pages,
+// protected by its own lock, so kalloc() and kfree() on
+// different CPUs do not contend. A CPU's list is refilled
+// from the buddy allocator, and given back to it, a batch
+// at a time. When the buddy allocator has no pages either,
+// a CPU steals a batch from another CPU's list. No two of
+// these locks are held at once.
+//
+// A huge page, for user memory mapped with a megapage (see
+// khugealloc()), is a block of MAXORDER. It is still
+// counted page by page: each of its pages has its own
+// reference count, so a megapage mapping can be split
+// into page mappings, and its pages freed one at a time.
+// They go straight back to the buddy allocator, so the
+// block is whole again once the last of them is freed.
 
 #include "types.h"
 #include "param.h"
@@ -14,22 +39,135 @@ void freerange(void *pa_start, void *pa_end);
 extern char end[]; // first address after kernel.
                    // defined by kernel.ld.
 
+#define NSTEAL 32  // max pages moved by one steal
+#define NBATCH 32  // pages moved between a CPU's list and the buddy lists
+#define NKEEP  128 // max pages on a CPU's list
+
+#define MAXORDER 9 // largest block: 2^9 pages, a huge page
+#define NCHUNK ((PHYSTOP - KERNBASE) / HPGSIZE)
+#define CHUNK(pa) ((((uint64) pa) - KERNBASE) / HPGSIZE)
+
 struct run {
   struct run *next;
+  struct run *prev; // only for blocks on the buddy lists
 };
 
-struct {
+struct kmem {
   struct spinlock lock;
   struct run *freelist;
-} kmem;
+  int nfree;
+};
+
+struct kmem kmem[NCPU];
+
+struct {
+  struct spinlock lock;
+  struct run free[MAXORDER+1];  // circular lists of free blocks
+  int nfree[MAXORDER+1];        // number of free blocks of each order
+  // for the first page of a free block, its order + 1;
+  // else 0. indexed by PGREF(pa).
+  char order[(PHYSTOP - KERNBASE) / PGSIZE];
+  // 1 for a page of a huge page, from khugealloc() until
+  // it is freed; indexed by PGREF(pa).
+  char huge[(PHYSTOP - KERNBASE) / PGSIZE];
+  short live[NCHUNK];           // pages of a huge page in use not yet freed
+  int nhuge;                    // huge pages in use
+
+  // statistics
+  int nsplit;
+  int nmerge;
+} buddy;
 
-uint64 refcounts[PHYSTOP / PGSIZE];
+// A page of zeros, mapped read-only and copy-on-write
+// wherever a process reads heap it has never written.
+// Its reference is never dropped, so it is never freed.
+char *zeropage;
+
+// Number of references to each physical page, indexed by
+// PGREF(pa). Only updated with atomic memory operations
+// (amoadd.w), so no lock is needed.
+int refcounts[(PHYSTOP - KERNBASE) / PGSIZE];
 
 void
 kinit()
 {
-  initlock(&kmem.lock, "kmem");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kmem[i].lock, "kmem");
+  initlock(&buddy.lock, "kmem_buddy");
+  for(int k = 0; k <= MAXORDER; k++)
+    buddy.free[k].next = buddy.free[k].prev = &buddy.free[k];
   freerange(end, (void*)PHYSTOP);
+  if((zeropage = kalloc()) == 0)
+    panic("kinit: zero page");
+  memset(zeropage, 0, PGSIZE);
+}
+
+// Add free block r of order k to its list.
+// Caller holds buddy.lock.
+static void
+bpush(struct run *r, int k)
+{
+  r->next = buddy.free[k].next;
+  r->prev = &buddy.free[k];
+  buddy.free[k].next->prev = r;
+  buddy.free[k].next = r;
+  buddy.nfree[k]++;
+  buddy.order[PGREF(r)] = k + 1;
+}
+
+// Take free block r of order k off its list.
+// Caller holds buddy.lock.
+static void
+bunlink(struct run *r, int k)
+{
+  r->prev->next = r->next;
+  r->next->prev = r->prev;
+  buddy.nfree[k]--;
+  buddy.order[PGREF(r)] = 0;
+}
+
+// Take a free block of order k, splitting a bigger one if
+// there is none. Returns 0 if there is no big enough block.
+// Caller holds buddy.lock.
+static struct run *
+bget(int k)
+{
+  struct run *r;
+  int j;
+
+  for(j = k; j <= MAXORDER && buddy.nfree[j] == 0; j++)
+    ;
+  if(j > MAXORDER)
+    return 0;
+  r = buddy.free[j].next;
+  bunlink(r, j);
+  // give back the upper half until the block is order k.
+  while(j > k){
+    j--;
+    bpush((struct run*)((char*)r + ((uint64)PGSIZE << j)), j);
+    buddy.nsplit++;
+  }
+  return r;
+}
+
+// Free block pa of order k, merging it with its buddy for
+// as long as the buddy is free.
+// Caller holds buddy.lock.
+static void
+bput(void *pa, int k)
+{
+  uint64 b;
+
+  for(; k < MAXORDER; k++){
+    b = KERNBASE + (((uint64)pa - KERNBASE) ^ ((uint64)PGSIZE << k));
+    if(buddy.order[PGREF(b)] != k + 1)
+      break;
+    bunlink((struct run*)b, k);
+    if(b < (uint64)pa)
+      pa = (void*)b;
+    buddy.nmerge++;
+  }
+  bpush((struct run*)pa, k);
 }
 
 void
@@ -37,10 +175,42 @@ freerange(void *pa_start, void *pa_end)
 {
   char *p;
   p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE) {
-    refcounts[PGREF(p)] = 0;
-    kfree(p);
+  acquire(&buddy.lock);
+  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
+    bput(p, 0);
+  release(&buddy.lock);
+}
+
+// Give up to n pages from CPU id's list back to the buddy
+// allocator.
+// Caller must have interrupts disabled.
+static void
+kdrain(int id, int n)
+{
+  struct run *r, *last;
+
+  acquire(&kmem[id].lock);
+  r = kmem[id].freelist;
+  if(r == 0){
+    release(&kmem[id].lock);
+    return;
+  }
+  if(n > kmem[id].nfree)
+    n = kmem[id].nfree;
+  last = r;
+  for(int j = 1; j < n; j++)
+    last = last->next;
+  kmem[id].freelist = last->next;
+  kmem[id].nfree -= n;
+  release(&kmem[id].lock);
+
+  last->next = 0;
+  acquire(&buddy.lock);
+  for(; r; r = last){
+    last = r->next;
+    bput(r, 0);
   }
+  release(&buddy.lock);
 }
 
 // Free the page of physical memory pointed at by v,
@@ -51,70 +221,313 @@ void
 kfree(void *pa)
 {
   struct run *r;
+  int id, c, n;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
-  // Do not free with multiple refcounts
-  if (refcounts[PGREF(pa)] > 1) {
-    kdecref((uint64)pa); // decrease ref count
+  // Drop one reference; only the last one frees the page.
+  // The decrement and the test are a single atomic step, so
+  // two CPUs dropping the last two references cannot both
+  // see a count > 1.
+  if (kdecref((uint64)pa) > 0)
     return;
-  }
 
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
 
+  // a page of a huge page goes straight back to the buddy
+  // lists, to be merged with the others. only the page's
+  // owner, which is now this call, sets or clears its flag,
+  // so the flag can be read without the lock. the chunk's
+  // other freed pages may be reused as ordinary pages, so
+  // the chunk's count can't tell.
+  if(buddy.huge[PGREF(pa)]){
+    c = CHUNK(pa);
+    acquire(&buddy.lock);
+    buddy.huge[PGREF(pa)] = 0;
+    bput(pa, 0);
+    if(--buddy.live[c] == 0)
+      buddy.nhuge--;
+    release(&buddy.lock);
+    return;
+  }
+
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  id = cpuid();
+  acquire(&kmem[id].lock);
+  r->next = kmem[id].freelist;
+  kmem[id].freelist = r;
+  n = ++kmem[id].nfree;
+  release(&kmem[id].lock);
+  if(n > NKEEP)
+    kdrain(id, NBATCH);
+  pop_off();
+}
+
+// Move up to NBATCH pages from the buddy allocator to CPU
+// id's list, and return one of them.
+// Caller must have interrupts disabled.
+static struct run *
+krefill(int id)
+{
+  struct run *r, *first, *last;
+  int n;
+
+  acquire(&buddy.lock);
+  first = last = bget(0);
+  for(n = 1; first && n < NBATCH; n++){
+    if((r = bget(0)) == 0)
+      break;
+    last->next = r;
+    last = r;
+  }
+  release(&buddy.lock);
+  if(first == 0)
+    return 0;
+
+  // keep the first page, cache the rest locally.
+  last->next = 0;
+  if(first->next){
+    acquire(&kmem[id].lock);
+    last->next = kmem[id].freelist;
+    kmem[id].freelist = first->next;
+    kmem[id].nfree += n - 1;
+    release(&kmem[id].lock);
+  }
+  return first;
+}
+
+// Move up to half of another CPU's free pages (at most
+// NSTEAL) to CPU id's list, and return one of them.
+// Only one kmem lock is held at a time.
+// Caller must have interrupts disabled.
+static struct run *
+ksteal(int id)
+{
+  struct run *r, *last;
+  int i, n;
+
+  for(i = 1; i < NCPU; i++){
+    struct kmem *victim = &kmem[(id + i) % NCPU];
+
+    acquire(&victim->lock);
+    r = victim->freelist;
+    if(r == 0){
+      release(&victim->lock);
+      continue;
+    }
+    n = (victim->nfree + 1) / 2;
+    if(n > NSTEAL)
+      n = NSTEAL;
+    last = r;
+    for(int j = 1; j < n; j++)
+      last = last->next;
+    victim->freelist = last->next;
+    victim->nfree -= n;
+    release(&victim->lock);
+
+    // keep the first page, cache the rest locally.
+    last->next = 0;
+    if(r->next){
+      acquire(&kmem[id].lock);
+      last->next = kmem[id].freelist;
+      kmem[id].freelist = r->next;
+      kmem[id].nfree += n - 1;
+      release(&kmem[id].lock);
+    }
+    return r;
+  }
+  return 0;
 }
 
 // Allocate one 4096-byte page of physical memory.
 // Returns a pointer that the kernel can use.
-// Returns 0 if the memory cannot be allocated.
+// Returns 0 if the memory cannot be allocated,
+// even after shrinking the buffer and page caches.
 void *
 kalloc(void)
 {
   struct run *r;
+  int id;
+
+  push_off();
+  id = cpuid();
+  acquire(&kmem[id].lock);
+  r = kmem[id].freelist;
+  if(r){
+    kmem[id].freelist = r->next;
+    kmem[id].nfree--;
+  }
+  release(&kmem[id].lock);
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  refcounts[PGREF(r)] = 1;
-  release(&kmem.lock);
+  if(r == 0)
+    r = krefill(id);
+  if(r == 0)
+    r = ksteal(id);
+  pop_off();
 
-  if(r)
+  if(r == 0 && (bshrink() || pcache_shrink()))
+    return kalloc();
+
+  if(r){
+    refcounts[PGREF(r)] = 1;
     memset((char*)r, 5, PGSIZE); // fill with junk
+  }
   return (void*)r;
 }
 
+// Allocate 2^order physically contiguous pages, aligned to
+// their size, e.g. for rings that a device reads and writes
+// directly. Each page has one reference. If there is no
+// free block that big, the pages on the CPUs' lists are
+// given back first, which may let blocks merge. Returns 0
+// if there is still none; the memory is not cleared.
+// Free with freepages().
+void *
+allocpages(int order)
+{
+  struct run *r;
+
+  if(order < 0 || order > MAXORDER)
+    panic("allocpages");
+  acquire(&buddy.lock);
+  r = bget(order);
+  release(&buddy.lock);
+  if(r == 0){
+    push_off();
+    for(int i = 0; i < NCPU; i++)
+      kdrain(i, NKEEP + 1);
+    pop_off();
+    acquire(&buddy.lock);
+    r = bget(order);
+    release(&buddy.lock);
+    if(r == 0)
+      return 0;
+  }
+  for(char *p = (char*)r; p < (char*)r + ((uint64)PGSIZE << order); p += PGSIZE)
+    refcounts[PGREF(p)] = 1;
+  return (void*)r;
+}
+
+// Free a block from allocpages(order), whose pages must
+// have only the reference it gave them.
+void
+freepages(void *pa, int order)
+{
+  uint64 n = (uint64)PGSIZE << order;
+
+  if(order < 0 || order > MAXORDER || (uint64)pa % n != 0 ||
+     (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("freepages");
+  for(char *p = (char*)pa; p < (char*)pa + n; p += PGSIZE)
+    if(kdecref((uint64)p) != 0)
+      panic("freepages: in use");
+  memset(pa, 1, n);
+  acquire(&buddy.lock);
+  bput(pa, order);
+  release(&buddy.lock);
+}
+
+// Allocate a huge page: 2 megabytes of physical memory,
+// aligned to 2 megabytes, each of whose pages has one
+// reference, and is freed by kfree(). Returns 0 if there
+// is no free huge page; the memory is not cleared.
+void *
+khugealloc(void)
+{
+  char *pa;
+
+  if((pa = allocpages(MAXORDER)) == 0)
+    return 0;
+  acquire(&buddy.lock);
+  for(char *p = pa; p < pa + HPGSIZE; p += PGSIZE)
+    buddy.huge[PGREF(p)] = 1;
+  buddy.live[CHUNK(pa)] = HPGSIZE/PGSIZE;
+  buddy.nhuge++;
+  release(&buddy.lock);
+  return pa;
+}
+
+// Drop a reference to each page of huge page pa.
+void
+khugefree(void *pa)
+{
+  for(char *p = (char*)pa; p < (char*)pa + HPGSIZE; p += PGSIZE)
+    kfree(p);
+}
+
 // Get amount of free memory in bytes
 uint64
 kgetfree(void)
 {
   uint64 num = 0;
-  struct run *r = kmem.freelist;
-  while (r) {
-    num++;
-    r = r->next;
+
+  for(int i = 0; i < NCPU; i++){
+    acquire(&kmem[i].lock);
+    num += kmem[i].nfree;
+    release(&kmem[i].lock);
   }
+  acquire(&buddy.lock);
+  for(int k = 0; k <= MAXORDER; k++)
+    num += (uint64)buddy.nfree[k] << k;
+  release(&buddy.lock);
   return num*PGSIZE;
 }
 
+// Get the number of huge pages in use and free.
 void
+kgethuge(uint64 *used, uint64 *free)
+{
+  acquire(&buddy.lock);
+  *used = buddy.nhuge;
+  *free = buddy.nfree[MAXORDER];
+  release(&buddy.lock);
+}
+
+// Print the number of free blocks of each order, and how
+// much of the free memory is in whole huge pages, as a
+// measure of fragmentation, for the statistics device.
+int
+statskalloc(char *buf, int sz)
+{
+  uint64 nfree = 0;
+  int n, k;
+
+  acquire(&buddy.lock);
+  n = snprintf(buf, sz, "--- buddy: free blocks by order:");
+  for(k = 0; k <= MAXORDER; k++){
+    n += snprintf(buf+n, sz-n, " %d", buddy.nfree[k]);
+    nfree += (uint64)buddy.nfree[k] << k;
+  }
+  n += snprintf(buf+n, sz-n, "\n--- buddy: split %d merge %d, huge %d%% of free\n",
+                buddy.nsplit, buddy.nmerge,
+                nfree ? (int)(((uint64)buddy.nfree[MAXORDER] << MAXORDER) * 100 / nfree) : 0);
+  release(&buddy.lock);
+  return n;
+}
+
+// Drop a reference to page pa.
+// Returns the number of references left.
+int
 kdecref(uint64 pa) {
-  acquire(&kmem.lock);
-  refcounts[PGREF(pa)] -= 1;
-  release(&kmem.lock);
+  int n = __atomic_sub_fetch(&refcounts[PGREF(pa)], 1, __ATOMIC_ACQ_REL);
+  if(n < 0)
+    panic("kdecref");
+  return n;
 }
 
+// Add a reference to page pa, which must already
+// have at least one (e.g. a COW page being shared).
 void
 kincref(uint64 pa) {
-  acquire(&kmem.lock);
-  refcounts[PGREF(pa)] += 1;
-  release(&kmem.lock);
+  __atomic_fetch_add(&refcounts[PGREF(pa)], 1, __ATOMIC_ACQ_REL);
+}
+
+// Number of references to page pa.
+int
+kgetref(uint64 pa) {
+  return __atomic_load_n(&refcounts[PGREF(pa)], __ATOMIC_ACQUIRE);
 }
@@ -10,30 +10,60 @@
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
+// calls. A transaction is only closed when there are
+// no FS system calls active in it. Thus there is never
 // any reasoning required about whether a commit might
 // write an uncommitted system call's updates to disk.
 //
 // A system call should call begin_op()/end_op() to mark
-// its start and end. Usually begin_op() just increments
-// the count of in-progress FS system calls and returns.
-// But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// its start and end. begin_op() reserves MAXOPBLOCKS blocks
+// of log space for the system call; begin_opn()/end_opn()
+// reserve a different amount, up to logcapacity(), for
+// system calls such as large writes. Usually begin_op() just
+// adds the reservation and returns. But if the log might run
+// out, it sleeps until the log writer has closed the
+// transaction.
+//
+// The size of the log is set by mkfs in the superblock,
+// up to LOGSIZE blocks.
+//
+// Commits are done by a kernel thread, the log writer, which
+// groups system calls into a transaction until the transaction
+// is half the log, has been open for COMMITTICKS, or some
+// begin_op() is waiting for space. It then closes the
+// transaction: once the system calls in it have ended, it
+// copies the transaction's blocks aside and opens a new,
+// empty transaction. New system calls fill the new transaction
+// while the writer commits the snapshot of the old one, so
+// end_op() does not wait for the disk; a system call's updates
+// are durable once the writer has committed its transaction.
 //
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
-//   header block, containing block #s for block A, B, C, ...
+//   commit block, containing a sequence number, block #s for
+//     block A, B, C, ..., and a checksum of all of them
 //   block A
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// commit() writes the commit block and the logged blocks as a
+// single batch, in any order; the checksum tells recovery
+// whether all of them reached the disk. It then installs the
+// blocks at their home locations. The commit block is not
+// cleared afterwards: replaying the last committed transaction
+// again is harmless, since nothing can have been written after
+// it without a later commit replacing it.
 
-// Contents of the header block, used for both the on-disk header block
+#define COMMITTICKS 1      // max ticks a transaction stays open
+#define TIMEPERMS 10000    // time CSR counts per ms, on qemu
+#define NHIST 12           // commit latency buckets: <1ms, <2ms, ... <1024ms, more
+
+// Contents of the commit block, used for both the on-disk commit block
 // and to keep track in memory of logged block# before commit.
 struct logheader {
   int n;
+  uint seq;    // commit sequence number
+  uint cksum;  // crc32 of n, seq, block[] and the logged blocks
   int block[LOGSIZE];
 };
 
@@ -42,14 +72,75 @@ struct log {
   int start;
   int size;
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int reserved;    // log blocks reserved by them.
+  int closing;     // writer is closing the transaction, please wait.
+  int waiting;     // how many begin_op()s are waiting for log space.
   int dev;
-  struct logheader lh;
+  struct logheader lh;  // the open transaction.
+  uint tid;             // the open transaction's number.
+  uint done;            // transactions before this one are committed.
+  int forcing;          // a logsync() wants lh committed now.
+  uint openticks;       // ticks when lh got its first block.
+  uint64 opentime;      // r_time() when lh got its first block.
+
+  // the closed transaction being committed. only the
+  // log writer (or recovery, before it starts) uses these.
+  struct logheader clh;
+  uchar *snap[LOGSIZE];        // clh's blocks as of closing.
+  struct buf *pinned[LOGSIZE]; // clh's blocks in the cache.
+  struct buf io[LOGSIZE];      // private bufs to write snap[] from.
+  struct buf hbuf;             // private buf for the commit block.
+  uchar hdata[BSIZE];
+  struct buf *iop[LOGSIZE+1];
+  uint seq;                    // last committed sequence number.
+
+  // statistics
+  int ncommit;
+  int nblock;
+  int hist[NHIST];
 };
 struct log log;
 
 static void recover_from_log(void);
-static void commit();
+static void logwriter(void);
+
+static uint crctab[256];
+
+static void
+crcinit(void)
+{
+  for (uint i = 0; i < 256; i++) {
+    uint c = i;
+    for (int k = 0; k < 8; k++)
+      c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+    crctab[i] = c;
+  }
+}
+
+static uint
+crc32(uint crc, void *p, int n)
+{
+  uchar *s = p;
+
+  crc = ~crc;
+  while (n-- > 0)
+    crc = crctab[(crc ^ *s++) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+// Checksum of the transaction in clh and snap[].
+static uint
+logsum(void)
+{
+  uint c;
+
+  c = crc32(0, &log.clh.n, sizeof(log.clh.n));
+  c = crc32(c, &log.clh.seq, sizeof(log.clh.seq));
+  c = crc32(c, log.clh.block, log.clh.n * sizeof(log.clh.block[0]));
+  for (int i = 0; i < log.clh.n; i++)
+    c = crc32(c, log.snap[i], BSIZE);
+  return c;
+}
 
 void
 initlog(int dev, struct superblock *sb)
@@ -59,57 +150,96 @@ initlog(int dev, struct superblock *sb)
 
   initlock(&log.lock, "log");
   log.start = sb->logstart;
-  log.size = sb->nlog;
+  log.size = sb->nlog - 1;  // less the commit block
+  if (log.size > LOGSIZE)
+    log.size = LOGSIZE;
+  if (log.size < CREATEOPBLOCKS)
+    panic("initlog: log too small");
   log.dev = dev;
+
+  // room for a snapshot of a full log.
+  uchar *page = 0;
+  for (int i = 0; i < log.size; i++) {
+    if (i % (PGSIZE/BSIZE) == 0 && (page = kalloc()) == 0)
+      panic("initlog: snap");
+    log.snap[i] = page + (i % (PGSIZE/BSIZE)) * BSIZE;
+    initsleeplock(&log.io[i].lock, "logbuf");
+    log.io[i].dev = dev;
+    log.io[i].data = log.snap[i];
+  }
+  initsleeplock(&log.hbuf.lock, "logbuf");
+  log.hbuf.dev = dev;
+  log.hbuf.blockno = log.start;
+  log.hbuf.data = log.hdata;
+  crcinit();
   recover_from_log();
+  if (kthread_create("logwriter", logwriter) < 0)
+    panic("initlog: logwriter");
 }
 
-// Copy committed blocks from log to their home location
+// Write snap[0..clh.n) through the private bufs, as one
+// batch: to the log, along with the commit block, if tolog;
+// else to the blocks' home locations. Runs of adjacent
+// blocks go out as single multi-block requests.
 static void
-install_trans(int recovering)
+write_snap(int tolog)
 {
-  int tail;
+  struct buf **b = log.iop;
+  int i, n, run;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
+  n = 0;
+  if (tolog) {
+    acquiresleep(&log.hbuf.lock);
+    b[n++] = &log.hbuf;
+  }
+  for (i = 0; i < log.clh.n; i++) {
+    acquiresleep(&log.io[i].lock);
+    if (tolog)
+      log.io[i].blockno = log.start+i+1;
+    else
+      log.io[i].blockno = log.clh.block[i];
+    b[n++] = &log.io[i];
+  }
+  for (i = 0; i < n; i += run) {
+    run = 1;
+    while (i + run < n && b[i+run]->blockno == b[i]->blockno + run)
+      run++;
+    bwritev_async(&b[i], run);
+  }
+  for (i = 0; i < n; i++) {
+    bwait(b[i]);
+    releasesleep(&b[i]->lock);
   }
 }
 
-// Read the log header from disk into the in-memory log header
+// Copy committed blocks from the snapshot to their home
+// location. The home blocks' cache bufs may already hold
+// newer, uncommitted data, so they are not used.
 static void
-read_head(void)
+install_trans(int recovering)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *lh = (struct logheader *) (buf->data);
-  int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+  write_snap(0);
+  if (recovering == 0) {
+    for (int i = 0; i < log.clh.n; i++)
+      bunpin(log.pinned[i]);
   }
-  brelse(buf);
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
+// Read the commit block from disk into the committing log header
 static void
-write_head(void)
+read_head(void)
 {
   struct buf *buf = bread(log.dev, log.start);
-  struct logheader *hb = (struct logheader *) (buf->data);
+  struct logheader *lh = (struct logheader *) (buf->data);
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  log.clh.n = lh->n;
+  log.clh.seq = lh->seq;
+  log.clh.cksum = lh->cksum;
+  if (log.clh.n < 0 || log.clh.n > log.size)
+    log.clh.n = 0;  // torn or foreign; the checksum will fail
+  for (i = 0; i < log.clh.n; i++) {
+    log.clh.block[i] = lh->block[i];
   }
-  bwrite(buf);
   brelse(buf);
 }
 
@@ -117,94 +247,235 @@ static void
 recover_from_log(void)
 {
   read_head();
-  install_trans(1); // if committed, copy from log to disk
-  log.lh.n = 0;
-  write_head(); // clear the log
+  log.seq = log.clh.seq;
+  for (int i = 0; i < log.clh.n; i++) {
+    struct buf *lbuf = bread(log.dev, log.start+i+1); // read log block
+    memmove(log.snap[i], lbuf->data, BSIZE);
+    brelse(lbuf);
+  }
+  if (log.clh.n > 0 && logsum() == log.clh.cksum)
+    install_trans(1); // committed, so copy from log to disk
+  log.clh.n = 0;
 }
 
-// called at the start of each FS system call.
+// The number of the open transaction, for a system call
+// in it; see bcommitted().
+uint
+logtid(void)
+{
+  uint tid;
+
+  acquire(&log.lock);
+  tid = log.tid;
+  release(&log.lock);
+  return tid;
+}
+
+// Wait until the system calls that have ended are
+// durable: commit the open transaction now, rather than
+// when its timer runs out, and wait for the writer.
 void
-begin_op(void)
+logsync(void)
 {
+  uint want;
+
+  acquire(&log.lock);
+  want = log.tid;
+  if(log.lh.n > 0){
+    want++;
+    log.forcing = 1;
+    wakeup(&ticks);
+  }
+  while((int)(want - log.done) > 0)
+    sleep(&log.done, &log.lock);
+  release(&log.lock);
+}
+
+// The most log blocks a single system call may reserve.
+int
+logcapacity(void)
+{
+  return log.size;
+}
+
+// called at the start of each FS system call that
+// may write up to n blocks.
+void
+begin_opn(int n)
+{
+  if(n > log.size)
+    panic("begin_opn");
+
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.closing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
-      // this op might exhaust log space; wait for commit.
+    } else if(log.lh.n + log.reserved + n > log.size){
+      // this op might exhaust log space; ask the writer
+      // to close the transaction now.
+      log.waiting += 1;
+      wakeup(&ticks);
       sleep(&log, &log.lock);
+      log.waiting -= 1;
     } else {
       log.outstanding += 1;
+      log.reserved += n;
       release(&log.lock);
       break;
     }
   }
 }
 
-// called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// called at the end of each FS system call started
+// with begin_opn(n).
 void
-end_op(void)
+end_opn(int n)
 {
-  int do_commit = 0;
-
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
-  } else {
-    // begin_op() may be waiting for log space,
-    // and decrementing log.outstanding has decreased
-    // the amount of reserved space.
-    wakeup(&log);
-  }
+  log.reserved -= n;
+  // the writer may be waiting for the transaction's last
+  // op to end, and begin_op() may be waiting for log
+  // space: giving back the reservation has made some.
+  wakeup(&log);
+  if(log.lh.n >= log.size/2)
+    wakeup(&ticks);
   release(&log.lock);
+}
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
+void
+begin_op(void)
+{
+  begin_opn(MAXOPBLOCKS);
+}
+
+void
+end_op(void)
+{
+  end_opn(MAXOPBLOCKS);
+}
+
+// Copy the closed transaction's blocks from the cache to
+// the snapshot. Called with new system calls held off, so
+// no one modifies the blocks meanwhile.
+static void
+snapshot(void)
+{
+  for (int i = 0; i < log.clh.n; i++) {
+    struct buf *b = bread(log.dev, log.clh.block[i]); // pinned, so cached
+    memmove(log.snap[i], b->data, BSIZE);
+    log.pinned[i] = b;
+    brelse(b);
   }
 }
 
-// Copy modified blocks from cache to log.
+// Record a commit that took t time counts from the
+// transaction's first block to its commit block being on disk.
 static void
-write_log(void)
+account(uint64 t)
 {
-  int tail;
+  int k;
+  uint64 ms = t / TIMEPERMS;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
-  }
+  for (k = 0; k < NHIST-1 && ms >= (1L << k); k++)
+    ;
+  log.hist[k]++;
+  log.ncommit++;
+  log.nblock += log.clh.n;
 }
 
 static void
-commit()
+commit(uint64 opentime)
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
+  if (log.clh.n > 0) {
+    log.clh.seq = ++log.seq;
+    log.clh.cksum = logsum();
+    memmove(log.hdata, &log.clh, sizeof(log.clh));
+    write_snap(1);    // Write commit block and snapshot -- the real commit
+    account(r_time() - opentime);
     install_trans(0); // Now install writes to home locations
+    log.clh.n = 0;
+  }
+}
+
+// Should the open transaction be closed now?
+// Caller holds log.lock.
+static int
+commitdue(void)
+{
+  if (log.lh.n == 0)
+    return 0;
+  return log.waiting > 0 || log.forcing || log.lh.n >= log.size/2 ||
+         ticks - log.openticks >= COMMITTICKS;
+}
+
+// The log writer thread. It sleeps on &ticks, so that
+// clockintr() wakes it every tick to check the commit
+// timer; begin_op() and end_op() wake it the same way
+// when a commit should not wait for the timer.
+static void
+logwriter(void)
+{
+  uint64 opentime;
+  uint tid;
+
+  acquire(&log.lock);
+  for(;;){
+    while (!commitdue())
+      sleep(&ticks, &log.lock);
+
+    // Close the transaction: hold off new system calls
+    // until the ones in it have ended and its blocks
+    // are copied aside.
+    log.closing = 1;
+    while (log.outstanding > 0)
+      sleep(&log, &log.lock);
+    log.clh = log.lh;
+    opentime = log.opentime;
+    tid = log.tid++;
     log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+    log.forcing = 0;
+    release(&log.lock);
+
+    snapshot();
+
+    acquire(&log.lock);
+    log.closing = 0;
+    wakeup(&log);
+    release(&log.lock);
+
+    commit(opentime);
+    bcommitted(tid);
+
+    acquire(&log.lock);
+    log.done = tid + 1;
+    wakeup(&log.done);
   }
 }
 
+// Print commit counts and the commit latency histogram,
+// for the statistics device.
+int
+statslog(char *buf, int sz)
+{
+  int n;
+
+  n = snprintf(buf, sz, "--- log: commits %d blocks %d\n",
+               log.ncommit, log.nblock);
+  n += snprintf(buf+n, sz-n, "commit latency (ms):");
+  for (int k = 0; k < NHIST; k++) {
+    if (k < NHIST-1)
+      n += snprintf(buf+n, sz-n, " <%d:%d", 1 << k, log.hist[k]);
+    else
+      n += snprintf(buf+n, sz-n, " more:%d", log.hist[k]);
+  }
+  n += snprintf(buf+n, sz-n, "\n");
+  return n;
+}
+
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache by increasing refcnt.
-// commit()/write_log() will do the disk write.
+// The log writer will do the disk write.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -217,7 +488,7 @@ log_write(struct buf *b)
   int i;
 
   acquire(&log.lock);
-  if (log.lh.n >= LOGSIZE || log.lh.n >= log.size - 1)
+  if (log.lh.n >= log.size)
     panic("too big a transaction");
   if (log.outstanding < 1)
     panic("log_write outside of trans");
@@ -228,9 +499,12 @@ log_write(struct buf *b)
   }
   log.lh.block[i] = b->blockno;
   if (i == log.lh.n) {  // Add new block to log?
+    if (i == 0) {
+      log.openticks = ticks;
+      log.opentime = r_time();
+    }
     bpin(b);
     log.lh.n++;
   }
   release(&log.lock);
 }
-
@@ -12,6 +12,7 @@ main()
 {
   if(cpuid() == 0){
     consoleinit();
+    statsinit();
     printfinit();
     printf("\n");
     printf("xv6 kernel is booting\n");
@@ -20,12 +21,15 @@ main()
     kvminit();       // create kernel page table
     kvminithart();   // turn on paging
     procinit();      // process table
+    vmainit();       // VMA allocator
     trapinit();      // trap vectors
     trapinithart();  // install kernel trap vector
     plicinit();      // set up interrupt controller
     plicinithart();  // ask PLIC for device interrupts
     binit();         // buffer cache
     iinit();         // inode table
+    dcacheinit();    // name lookup cache
+    pcacheinit();    // file page cache
     fileinit();      // file table
     virtio_disk_init(); // emulated hard disk
   #ifdef LAB_NET
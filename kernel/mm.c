@@ -12,9 +12,170 @@
 #include "proc.h"
 #include "fcntl.h"
 
+// A process's VMAs are kept in p->vmas, an array of
+// pointers sorted by address, which fills one page
+// allocated at the first mapping; so a fault finds its VMA
+// by binary search. The VMAs themselves come from vmapool,
+// which carves whole pages into them. VMAs are page-aligned
+// and do not overlap. They are private to the process, so
+// p->lock need not be held.
+//
+// p->vmahint is a first-fit hint for mmap: every page from
+// the top of the heap up to it is in some VMA, so the
+// search for a free region starts there. Only unmapping
+// a VMA or shrinking the heap opens a gap below it, and
+// lowers it.
+
+struct {
+  struct spinlock lock;
+  struct vma *free;
+} vmapool;
+
 uint64 findregion(uint64 size);
-int invma(uint64 addr);
-void clear_vma();
+static void vmadup(struct vma *v);
+static int vmawriteback(struct proc *p, struct vma *v, uint64 start, uint64 end);
+static void vmaprefetch(struct vma *v, uint64 start, uint64 end);
+
+void
+vmainit(void)
+{
+  initlock(&vmapool.lock, "vmapool");
+}
+
+// allocate a zeroed VMA, or return 0 if out of memory
+struct vma*
+vmaalloc(void)
+{
+  struct vma *v;
+  char *pg;
+
+  acquire(&vmapool.lock);
+  if (vmapool.free == 0) {
+    release(&vmapool.lock);
+    if ((pg = kalloc()) == 0)
+      return 0;
+    acquire(&vmapool.lock);
+    for (v = (struct vma*)pg; v + 1 <= (struct vma*)(pg + PGSIZE); v++) {
+      v->next = vmapool.free;
+      vmapool.free = v;
+    }
+  }
+  v = vmapool.free;
+  vmapool.free = v->next;
+  release(&vmapool.lock);
+
+  memset(v, 0, sizeof(*v));
+  return v;
+}
+
+// return a VMA that holds no references to the pool
+static void
+vmafree(struct vma *v)
+{
+  acquire(&vmapool.lock);
+  v->next = vmapool.free;
+  vmapool.free = v;
+  release(&vmapool.lock);
+}
+
+// make sure p has its array of VMAs
+// return -1 if out of memory
+int
+vmaspace(struct proc *p)
+{
+  if (p->vmas == 0 && (p->vmas = kalloc()) == 0)
+    return -1;
+  return 0;
+}
+
+// index of the first VMA of p that ends after addr,
+// or p->nvma if there is none
+static int
+vmasearch(struct proc *p, uint64 addr)
+{
+  int lo = 0, hi = p->nvma, mid;
+
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (p->vmas[mid]->addr + p->vmas[mid]->length <= addr)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// return the VMA of the current process holding addr, or 0
+struct vma*
+vmalookup(uint64 addr)
+{
+  struct proc *p = myproc();
+  int i = vmasearch(p, addr);
+
+  if (i < p->nvma && p->vmas[i]->addr <= addr)
+    return p->vmas[i];
+  return 0;
+}
+
+// check if any VMA overlaps [start, end)
+int
+vmaoverlap(uint64 start, uint64 end)
+{
+  struct proc *p = myproc();
+  int i = vmasearch(p, start);
+
+  return i < p->nvma && p->vmas[i]->addr < end;
+}
+
+// can b, which starts where a ends, be merged into a?
+static int
+mergeable(struct vma *a, struct vma *b)
+{
+  return a->addr + a->length == b->addr && a->f == b->f && a->ip == b->ip &&
+         a->perm == b->perm && a->flags == b->flags && a->advice == b->advice &&
+         a->filelen == a->length && a->offset + a->length == b->offset;
+}
+
+// take the VMA at index i out of p's array
+static void
+vmaremove(struct proc *p, int i)
+{
+  memmove(&p->vmas[i], &p->vmas[i+1], (p->nvma - i - 1) * sizeof(p->vmas[0]));
+  p->nvma--;
+}
+
+// merge the VMAs at index i and i+1, if they are compatible
+static void
+vmamerge(struct proc *p, int i)
+{
+  struct vma *a = p->vmas[i], *b = p->vmas[i+1];
+
+  if (!mergeable(a, b))
+    return;
+  a->length += b->length;
+  a->filelen += b->filelen;
+  vmaremove(p, i+1);
+  vmaput(b);
+}
+
+// add v to the current process's VMAs, merging it with
+// its neighbours if they are compatible. the caller has
+// checked that v overlaps none of them, and that there
+// is room: the array exists and is not full.
+void
+vmaadd(struct vma *v)
+{
+  struct proc *p = myproc();
+  int i = vmasearch(p, v->addr);
+
+  memmove(&p->vmas[i+1], &p->vmas[i], (p->nvma - i) * sizeof(p->vmas[0]));
+  p->vmas[i] = v;
+  p->nvma++;
+  if (i + 1 < p->nvma)
+    vmamerge(p, i);
+  if (i > 0)
+    vmamerge(p, i - 1);
+}
 
 uint64
 sys_mmap(void)
@@ -24,8 +185,10 @@ sys_mmap(void)
   int flags;
   int fd;
   struct file *f;
+  struct vma *v;
   int offset = 0;
-  uint64 addr;
+  uint64 addr, a;
+  pte_t *pte;
   struct proc *p = myproc();
 
   // read arugment 
@@ -34,6 +197,10 @@ sys_mmap(void)
     printf("bad file\n");
     return -1;
   }
+  if (length <= 0) {
+    return -1;
+  }
+  length = PGROUNDUP(length);
 
   // get file from descriptor
   if(fd < 0 || fd >= NOFILE || (f=p->ofile[fd]) == 0) {
@@ -51,33 +218,42 @@ sys_mmap(void)
     printf("bad perm\n");
     return -1;
   }
+  // nor may a running program's text be changed through one
+  if ((prot & PROT_WRITE) && (flags & MAP_SHARED) && f->ip->nexec > 0) {
+    return -1;
+  }
 
   // find an unused region
-  acquire(&p->vma_lock);
-  addr = findregion(length);
+  if (p->nvma == NVMA || vmaspace(p) < 0 || (addr = findregion(length)) == 0) {
+    return -1;
+  }
+  if ((v = vmaalloc()) == 0) {
+    return -1;
+  }
 
-  // add to process's VMA
-  int i;
-  for (i = 0; i < NVMA; i++) {
-    if (p->vma_areas[i].addr == 0) {
-        p->vma_areas[i].addr = addr;
-        p->vma_areas[i].length = length;
-        p->vma_areas[i].perm = prot;
-        p->vma_areas[i].f = f;
-        p->vma_areas[i].offset = offset;
-        p->vma_areas[i].flags = flags;
+  // add to process's VMA, with its own file reference
+  v->addr = addr;
+  v->length = length;
+  v->perm = prot;
+  v->f = filedup(f);
+  v->ip = f->ip;
+  v->offset = offset;
+  v->filelen = length;
+  v->flags = flags;
+  vmaadd(v);
+
+  // fault the whole mapping in now; vmaload() maps many
+  // pages at a time. v may have been merged into another
+  // VMA, so look it up. it is only a hint: if memory runs
+  // out, the rest is loaded when touched.
+  if (flags & MAP_POPULATE) {
+    for (a = addr; a < addr + length; a += PGSIZE) {
+      pte = walk(p->pagetable, a, 0);
+      if ((pte == 0 || (*pte & PTE_V) == 0) && vmaload(vmalookup(a), a) < 0)
         break;
     }
   }
-  release(&p->vma_lock);
 
-  if (i == NVMA) {
-    return -1;
-  }
-
-  // increase file ref count
-  filedup(f);
-  
   return addr;
 }
 
@@ -86,132 +262,346 @@ sys_munmap(void)
 {
   // read argument
   int length;
-  uint64 addr;
+  uint64 addr, end, s, e;
   struct proc *p = myproc();
+  struct vma *v, *nv;
   int i;
 
   if (argaddr(0, &addr) < 0 || argint(1, &length))
     return -1;
 
-  if (length % PGSIZE) {
-    return -1; // length must be page size aligned
+  if (length % PGSIZE || addr % PGSIZE) {
+    return -1; // length and addr must be page size aligned
   }
+  end = addr + length;
 
-  // find which VMA 
-  i = invma(addr);
-  if (i == -1) {
+  // find the first VMA in the range
+  i = vmasearch(p, addr);
+  if (i == p->nvma || p->vmas[i]->addr >= end) {
     printf("unmap: unknown VMA region: %p\n", addr);
     return -1;
   }
 
-  // write back dirty pages
-  if (p->vma_areas[i].flags & MAP_SHARED) {
-    filewrite(p->vma_areas[i].f, addr, length);
+  // a huge page that is only partly unmapped is split. huge
+  // pages lie within one VMA, so only the ends of the range
+  // can cut one.
+  if (uvmsplit(p->pagetable, addr) < 0 || uvmsplit(p->pagetable, end) < 0)
+    return -1;
+
+  // a hole in the middle of a VMA splits it in two. only
+  // the first VMA can have one, if it holds the whole range;
+  // get what the split needs before changing anything.
+  v = p->vmas[i];
+  nv = 0;
+  if (addr > v->addr && end < v->addr + v->length) {
+    if (p->nvma == NVMA || (nv = vmaalloc()) == 0)
+      return -1;
   }
 
-  // unmap the region
-  uint64 start = addr;
-  int npages = length / PGSIZE;
-  uint64 a;
-  pte_t *pte;
+  // unmap the part of each VMA in the range
+  while (i < p->nvma && p->vmas[i]->addr < end) {
+    v = p->vmas[i];
+    s = addr > v->addr ? addr : v->addr;
+    e = end < v->addr + v->length ? end : v->addr + v->length;
 
-  for (a = start; a < start + npages*PGSIZE; a = a + PGSIZE) {
-    pte = walk(p->pagetable, a, 0);
-    if (*pte & PTE_V) {
-      uvmunmap(p->pagetable, start, npages, 1);
+    // write back dirty pages
+    vmawriteback(p, v, s, e);
+
+    // unmap the region; pages never touched were never mapped.
+    uvmunmap(p->pagetable, s, (e - s) / PGSIZE, 1);
+
+    if (s == v->addr && e == v->addr + v->length) {
+      // all region unmapped: drop the file
+      vmaremove(p, i);
+      vmaput(v);
+      continue;
     }
+    if (nv) {
+      // the part after the hole becomes a new VMA
+      *nv = *v;
+      vmadup(nv);
+      nv->addr = e;
+      nv->length = v->addr + v->length - e;
+      nv->offset = v->offset + (e - v->addr);
+      nv->filelen = v->filelen - (e - v->addr);
+      if (nv->filelen < 0)
+        nv->filelen = 0;
+      memmove(&p->vmas[i+2], &p->vmas[i+1], (p->nvma - i - 1) * sizeof(p->vmas[0]));
+      p->vmas[i+1] = nv;
+      p->nvma++;
+    }
+    if (s == v->addr) {
+      // update VMA info if its start got unmapped
+      v->offset += e - v->addr;
+      v->filelen -= e - v->addr;
+      if (v->filelen < 0)
+        v->filelen = 0;
+      v->length -= e - v->addr;
+      v->addr = e;
+    } else {
+      // or its end
+      v->length = s - v->addr;
+      if (v->filelen > v->length)
+        v->filelen = v->length;
+    }
+    i++;
   }
-  
-  // decrease file ref count if all region unmapped
-  if (length == p->vma_areas[i].length) {
-    filededup(p->vma_areas[i].f);
-    memset(&p->vma_areas[i], 0, sizeof(p->vma_areas[i])); // clear VMA
-  } else {
-    // update VMA info if some region got unmapped
-    p->vma_areas[i].addr += length;
-    p->vma_areas[i].length -= length;
-  }
+  if (addr < p->vmahint)
+    p->vmahint = addr;
 
   return 0;
 }
 
-// find a free virtual memory regeion
-// of size at least n pages
-// return the start of the virtal
 uint64
-findregion(uint64 size) 
+sys_msync(void)
+{
+  int length, flags;
+  uint64 addr, end, s, e;
+  struct proc *p = myproc();
+  struct vma *v;
+  int i, r;
+
+  if (argaddr(0, &addr) < 0 || argint(1, &length) < 0 || argint(2, &flags) < 0)
+    return -1;
+  if (addr % PGSIZE || length < 0 || (flags & ~(MS_ASYNC|MS_SYNC)) ||
+      (flags & (MS_ASYNC|MS_SYNC)) == (MS_ASYNC|MS_SYNC))
+    return -1;
+  end = addr + PGROUNDUP(length);
+
+  i = vmasearch(p, addr);
+  if (i == p->nvma || p->vmas[i]->addr >= end)
+    return -1;
+
+  // hand the dirty pages to the file system; with MS_SYNC,
+  // also wait until they are on disk.
+  r = 0;
+  for (; i < p->nvma && p->vmas[i]->addr < end; i++) {
+    v = p->vmas[i];
+    s = addr > v->addr ? addr : v->addr;
+    e = end < v->addr + v->length ? end : v->addr + v->length;
+    if (vmawriteback(p, v, s, e) < 0)
+      r = -1;
+    if ((flags & MS_SYNC) && (v->flags & MAP_SHARED))
+      isync(v->ip);
+  }
+
+  return r;
+}
+
+uint64
+sys_madvise(void)
+{
+  int length, advice;
+  uint64 addr, end, s, e;
+  struct proc *p = myproc();
+  struct vma *v;
+  int i;
+
+  if (argaddr(0, &addr) < 0 || argint(1, &length) < 0 || argint(2, &advice) < 0)
+    return -1;
+  if (addr % PGSIZE || length < 0 || advice < MADV_NORMAL || advice > MADV_DONTNEED)
+    return -1;
+  end = addr + PGROUNDUP(length);
+
+  i = vmasearch(p, addr);
+  if (i == p->nvma || p->vmas[i]->addr >= end)
+    return -1;
+
+  for (; i < p->nvma && p->vmas[i]->addr < end; i++) {
+    v = p->vmas[i];
+    s = addr > v->addr ? addr : v->addr;
+    e = end < v->addr + v->length ? end : v->addr + v->length;
+    switch (advice) {
+    case MADV_NORMAL:
+    case MADV_RANDOM:
+    case MADV_SEQUENTIAL:
+      // a pattern of use applies to all of each VMA
+      // in the range; see faultaround().
+      v->advice = advice;
+      break;
+    case MADV_WILLNEED:
+      vmaprefetch(v, s, e);
+      break;
+    case MADV_DONTNEED:
+      // drop the pages; touching them again loads them
+      // from the file, or zeros, again.
+      // pages that can't be written back are kept.
+      if (uvmsplit(p->pagetable, s) < 0 || uvmsplit(p->pagetable, e) < 0 ||
+          vmawriteback(p, v, s, e) < 0)
+        return -1;
+      uvmunmap(p->pagetable, s, (e - s) / PGSIZE, 1);
+      break;
+    }
+  }
+
+  return 0;
+}
+
+// start reading the file's part of [start, end) of v
+// into the buffer cache, without waiting for it.
+static void
+vmaprefetch(struct vma *v, uint64 start, uint64 end)
+{
+  uint lo, hi;
+
+  if (start >= v->addr + v->filelen)
+    return;
+  if (end > v->addr + v->filelen)
+    end = v->addr + v->filelen;
+  lo = (v->offset + (start - v->addr)) / BSIZE;
+  hi = (v->offset + (end - v->addr) + BSIZE - 1) / BSIZE;
+
+  ilock(v->ip);
+  ireadahead(v->ip, lo, hi - lo);
+  iunlock(v->ip);
+}
+
+// write the pages of shared mapping v in [start, end) that
+// the process has stored to, as the hardware records in
+// their PTE_D bits, back to the file, and clear the bits.
+// a page is written at its own offset in the file, and only
+// up to the end of the file: a mapping doesn't extend it.
+// a page whose write fails stays dirty, to be tried again.
+// return -1 if any write failed.
+static int
+vmawriteback(struct proc *p, struct vma *v, uint64 start, uint64 end)
 {
   uint64 a;
   pte_t *pte;
+  uint off, size;
+  int n, r = 0;
+
+  if (!(v->flags & MAP_SHARED) || !(v->perm & PROT_WRITE))
+    return 0;
+
+  ilock(v->ip);
+  size = v->ip->size;
+  iunlock(v->ip);
+
+  for (a = start; a < end; a += PGSIZE) {
+    pte = walk(p->pagetable, a, 0);
+    if (pte == 0 || (*pte & (PTE_V|PTE_D)) != (PTE_V|PTE_D))
+      continue;
+
+    off = v->offset + (a - v->addr);
+    if (off < size) {
+      n = size - off < PGSIZE ? size - off : PGSIZE;
+      if (filewriteat(v->f, (char*)PTE2PA(*pte), off, n) != n) {
+        r = -1;
+        continue;
+      }
+    }
+    *pte &= ~PTE_D;
+    sfence_vma();
+  }
+  return r;
+}
+
+// find a free virtual memory regeion of at least size
+// bytes above the heap, in the first gap after the hint
+// that is big enough; aligned to 2 megabytes if it is at
+// least that big, so that it can use huge pages.
+// return the start of the virtal, or 0
+uint64
+findregion(uint64 size) 
+{
   struct proc *p = myproc();
-  pagetable_t pagetable = p->pagetable;
   uint64 start = PGROUNDUP(p->sz);
   uint64 limit = MAXVA - 2*PGSIZE;
-  uint64 max_start = limit - size;
+  int i;
 
   size = PGROUNDUP(size);
   if(size == 0)
     return 0;
 
-  while(start <= max_start){
-    // printf("start: %p\n", start);
-    for(a = start; a < start + size; a += PGSIZE){
-      if (invma(a) != -1)
-        break;
-      pte = walk(pagetable, a, 0);
-      if(pte != 0 && (*pte & PTE_V))
-        break;
-    }
-    if(a >= start + size)
-      return start;
+  // skip the VMAs that follow the hint without a gap, and
+  // move the hint past them.
+  if (p->vmahint > start)
+    start = p->vmahint;
+  for (i = vmasearch(p, start); i < p->nvma && p->vmas[i]->addr <= start; i++)
+    start = p->vmas[i]->addr + p->vmas[i]->length;
+  p->vmahint = start;
 
-    start = PGROUNDUP(a + PGSIZE);
+  for (; ; i++) {
+    if (size >= HPGSIZE)
+      start = HPGROUNDUP(start);
+    if (i == p->nvma || p->vmas[i]->addr >= start + size)
+      break;
+    start = p->vmas[i]->addr + p->vmas[i]->length;
   }
 
-  return 0;
+  if (start + size > limit)
+    return 0;
+  return start;
+}
+
+// take another reference to the file or inode
+// mapped by a VMA being copied
+static void
+vmadup(struct vma *v)
+{
+  if (v->f) {
+    filedup(v->f);
+  } else {
+    idup(v->ip);
+    __sync_fetch_and_add(&v->ip->nexec, 1);
+  }
+}
+
+// drop a VMA's file or inode and free it
+void
+vmaput(struct vma *v)
+{
+  if (v->f) {
+    fileclose(v->f);
+  } else {
+    __sync_fetch_and_sub(&v->ip->nexec, 1);
+    begin_op();
+    iput(v->ip);
+    end_op();
+  }
+  vmafree(v);
 }
 
-// check if a given address is in process's VMA table
-// return the index in VMA table if found 
-// otherwise return -1
+// copy p's VMAs to np, as fork does
+// return -1 if out of memory
 int
-invma(uint64 addr) 
+vmacopy(struct proc *np, struct proc *p)
 {
   int i;
-  struct proc *p = myproc();
 
-  for (i = 0; i < NVMA; i++) {
-    if (p->vma_areas[i].addr == 0) {
-      continue;
-    }
-    if (addr >= p->vma_areas[i].addr && addr < p->vma_areas[i].addr + p->vma_areas[i].length) {
-      return i;
+  if (p->nvma == 0)
+    return 0;
+  if (vmaspace(np) < 0)
+    return -1;
+  for (i = 0; i < p->nvma; i++) {
+    if ((np->vmas[i] = vmaalloc()) == 0) {
+      while (--i >= 0)
+        vmafree(np->vmas[i]);
+      return -1;
     }
+    *np->vmas[i] = *p->vmas[i];
   }
-
-  return -1;
+  for (i = 0; i < p->nvma; i++)
+    vmadup(np->vmas[i]);
+  np->nvma = p->nvma;
+  np->vmahint = p->vmahint;
+  return 0;
 }
 
-// clear all VMA
+// unmap and clear all VMA,
+// as on exit or exec
 void
 clear_vma() 
 {
-  int i;
-  uint64 a, start;
-  pte_t *pte;
   struct proc *p = myproc();
+  struct vma *v;
 
-  for (i = 0; i < NVMA; i++) {
-    start = p->vma_areas[i].addr;
-    if (!start) {
-        continue;
-    }
-
-    for (a = start; a < start + p->vma_areas[i].length; a = a + PGSIZE) {
-        pte = walk(p->pagetable, a, 0);
-        if (*pte & PTE_V) {
-            uvmunmap(p->pagetable, a, 1, 1);
-        }
-    }
+  while (p->nvma > 0) {
+    v = p->vmas[--p->nvma];
+    vmawriteback(p, v, v->addr, v->addr + v->length);
+    uvmunmap(p->pagetable, v->addr, v->length / PGSIZE, 1);
+    vmaput(v);
   }
+  p->vmahint = 0;
 }
@@ -5,9 +5,13 @@ struct vma {
     uint64 addr; // start address of the vma
     int length; // length of the vma 
     int perm; // permissions
-    struct file *f; // pointer to file
+    struct file *f; // pointer to file, or 0 for a program segment
+    struct inode *ip; // inode whose pages are mapped
     int offset; // file offset
+    int filelen; // bytes backed by the file; the rest reads as zero
     int flags; // flags
+    int advice; // how the process will use it: MADV_NORMAL, &c
+    struct vma *next; // next free VMA in vmapool
 };
 #endif 
 
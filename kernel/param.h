@@ -2,14 +2,19 @@
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE     2000  // maximum number of cached i-nodes
+#define NDENTRY    2000  // size of the name lookup cache
+#define NPAGE      1024  // size of the file page cache, in pages
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
-#define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
+#define MAXOPBLOCKS  16  // max # of blocks any FS op writes
+#define LOGSIZE      250  // max data blocks in on-disk log; mkfs makes it this big
+#define NDIRTY      1024  // dirty file blocks before writers wait for write-back
+#define NBUFMIN      (2*LOGSIZE+MAXOPBLOCKS+2*NDIRTY)  // buffer cache never shrinks below this
+#define BCACHEFRAC   16  // buffer cache gets 1/BCACHEFRAC of free memory at boot
+#define RAMAX        32  // max read-ahead window, in blocks
 #define FSSIZE       200000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
 #define MAXDEPTH     10 // maximum depth for iterated symbolic links
-#define NVMA         16 // maximum number of VMA per process
+#define NVMA        512 // maximum number of VMA per process; a page of pointers
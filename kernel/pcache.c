@@ -0,0 +1,238 @@
+// Page cache.
+//
+// Keeps whole 4096-byte pages of regular files, keyed by
+// (dev, inum, page number), so that read(), page faults in
+// mmap()ed regions and exec() share one copy of a file's
+// data. A MAP_SHARED mapping maps the cached page itself,
+// so processes mapping the same file see each other's
+// stores, and read() sees them too.
+//
+// Pages are ordinary kalloc() pages. The cache holds one
+// reference to each; pcache_lookup() gives the caller
+// another, which it drops with kfree(), or keeps in a page
+// table entry to be dropped by uvmunmap(). A page can be
+// reused for other data only when the cache holds its sole
+// reference. The part of a page past the end of the file
+// is zero.
+//
+// The cache must agree with the file's blocks: writei()
+// copies what it writes into the cached page, and itrunc()
+// drops the file's pages. Callers hold the inode's
+// ip->lock, which orders filling, updating and dropping a
+// file's pages; pcache.lock only protects the table.
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define NPHASH 251  // number of hash chains; prime
+
+struct page {
+  uint dev;
+  uint inum;
+  uint pgno;
+  char *pa;           // the cached page; 0 if unused
+  struct page *hnext; // hash chain
+  struct page *lprev; // LRU list, least recent first
+  struct page *lnext;
+};
+
+struct {
+  struct spinlock lock;
+  struct page *hash[NPHASH];
+  struct page lru;
+  struct page page[NPAGE];
+
+  // statistics
+  int nhit;
+  int nmiss;
+} pcache;
+
+static uint
+phash(uint dev, uint inum, uint pgno)
+{
+  return ((dev << 24) ^ (inum << 8) ^ pgno) % NPHASH;
+}
+
+static void
+lru_remove(struct page *pg)
+{
+  pg->lprev->lnext = pg->lnext;
+  pg->lnext->lprev = pg->lprev;
+}
+
+// Make pg the most recently used entry.
+static void
+lru_append(struct page *pg)
+{
+  pg->lnext = &pcache.lru;
+  pg->lprev = pcache.lru.lprev;
+  pcache.lru.lprev->lnext = pg;
+  pcache.lru.lprev = pg;
+}
+
+static void
+hash_remove(struct page *pg)
+{
+  struct page **pp;
+
+  for(pp = &pcache.hash[phash(pg->dev, pg->inum, pg->pgno)]; *pp; pp = &(*pp)->hnext){
+    if(*pp == pg){
+      *pp = pg->hnext;
+      break;
+    }
+  }
+  pg->hnext = 0;
+}
+
+// Drop pg's page from the cache, and make the entry the
+// next to be reused. Caller holds pcache.lock.
+static void
+pfree(struct page *pg)
+{
+  hash_remove(pg);
+  kfree(pg->pa);
+  pg->pa = 0;
+  lru_remove(pg);
+  pg->lnext = pcache.lru.lnext;
+  pg->lprev = &pcache.lru;
+  pcache.lru.lnext->lprev = pg;
+  pcache.lru.lnext = pg;
+}
+
+// Caller holds pcache.lock.
+static struct page*
+pfind(uint dev, uint inum, uint pgno)
+{
+  struct page *pg;
+
+  for(pg = pcache.hash[phash(dev, inum, pgno)]; pg; pg = pg->hnext)
+    if(pg->pgno == pgno && pg->inum == inum && pg->dev == dev)
+      return pg;
+  return 0;
+}
+
+void
+pcacheinit(void)
+{
+  initlock(&pcache.lock, "pcache");
+  pcache.lru.lnext = pcache.lru.lprev = &pcache.lru;
+  for(int i = 0; i < NPAGE; i++)
+    lru_append(&pcache.page[i]);
+}
+
+// Return page pgno of inode inum, with a reference for the
+// caller, or 0 if it isn't cached.
+char*
+pcache_lookup(uint dev, uint inum, uint pgno)
+{
+  struct page *pg;
+  char *pa;
+
+  acquire(&pcache.lock);
+  pg = pfind(dev, inum, pgno);
+  if(pg == 0){
+    pcache.nmiss++;
+    release(&pcache.lock);
+    return 0;
+  }
+  pcache.nhit++;
+  pa = pg->pa;
+  kincref((uint64)pa);
+  lru_remove(pg);
+  lru_append(pg);
+  release(&pcache.lock);
+  return pa;
+}
+
+// Cache pa, a page the caller has filled with page pgno of
+// inode inum. The caller keeps its reference. If every
+// entry holds a page that is in use, pa is not cached.
+void
+pcache_insert(uint dev, uint inum, uint pgno, char *pa)
+{
+  struct page *pg;
+
+  acquire(&pcache.lock);
+  if(pfind(dev, inum, pgno) != 0)
+    panic("pcache_insert");
+  for(pg = pcache.lru.lnext; pg != &pcache.lru; pg = pg->lnext)
+    if(pg->pa == 0 || kgetref((uint64)pg->pa) == 1)
+      break;
+  if(pg == &pcache.lru){
+    release(&pcache.lock);
+    return;
+  }
+  if(pg->pa)
+    pfree(pg);
+  lru_remove(pg);
+  pg->dev = dev;
+  pg->inum = inum;
+  pg->pgno = pgno;
+  pg->pa = pa;
+  kincref((uint64)pa);
+  pg->hnext = pcache.hash[phash(dev, inum, pgno)];
+  pcache.hash[phash(dev, inum, pgno)] = pg;
+  lru_append(pg);
+  release(&pcache.lock);
+}
+
+// Copy n bytes from src, just written to inode inum at byte
+// offset off, into the cached page, if any. The bytes must
+// lie within one page.
+void
+pcache_update(uint dev, uint inum, uint off, char *src, uint n)
+{
+  struct page *pg;
+
+  acquire(&pcache.lock);
+  if((pg = pfind(dev, inum, off / PGSIZE)) != 0)
+    memmove(pg->pa + off % PGSIZE, src, n);
+  release(&pcache.lock);
+}
+
+// Drop all cached pages of inode inum, which is being
+// truncated. Pages still mapped by processes live on until
+// they are unmapped, but are no longer the file's.
+void
+pcache_inval(uint dev, uint inum)
+{
+  acquire(&pcache.lock);
+  for(int i = 0; i < NPAGE; i++){
+    struct page *pg = &pcache.page[i];
+    if(pg->pa && pg->inum == inum && pg->dev == dev)
+      pfree(pg);
+  }
+  release(&pcache.lock);
+}
+
+// Free the least recently used page that no process is
+// using. Called by kalloc() when it runs out of pages.
+// Returns 1 if a page was freed.
+int
+pcache_shrink(void)
+{
+  struct page *pg;
+
+  acquire(&pcache.lock);
+  for(pg = pcache.lru.lnext; pg != &pcache.lru; pg = pg->lnext){
+    if(pg->pa && kgetref((uint64)pg->pa) == 1){
+      pfree(pg);
+      release(&pcache.lock);
+      return 1;
+    }
+  }
+  release(&pcache.lock);
+  return 0;
+}
+
+// Print the page cache counters, for the statistics device.
+int
+statspcache(char *buf, int sz)
+{
+  return snprintf(buf, sz, "--- pcache: hit %d miss %d\n",
+                  pcache.nhit, pcache.nmiss);
+}
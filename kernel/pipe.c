@@ -47,6 +47,7 @@ pipealloc(struct file **f0, struct file **f1)
 
  bad:
   if(pi) {
+    freelock(&pi->lock);
     kfree((char*)pi);
   }
   if(*f0)
@@ -69,6 +70,7 @@ pipeclose(struct pipe *pi, int writable)
   }
   if(pi->readopen == 0 && pi->writeopen == 0){
     release(&pi->lock);
+    freelock(&pi->lock);
     kfree((char*)pi);
   } else
     release(&pi->lock);
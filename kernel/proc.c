@@ -52,7 +52,6 @@ procinit(void)
   initlock(&wait_lock, "wait_lock");
   for(p = proc; p < &proc[NPROC]; p++) {
       initlock(&p->lock, "proc");
-      initlock(&p->vma_lock, "vma");
       p->kstack = KSTACK((int) (p - proc));
   }
 }
@@ -159,25 +158,27 @@ found:
 static void
 freeproc(struct proc *p)
 {
-  if(p->trapframe) {
-    kdecref((uint64)p->trapframe);
+  if(p->trapframe)
     kfree((void*)p->trapframe);
-  }
   p->trapframe = 0;
-  if(p->uframe) {
-    kdecref((uint64)p->uframe);
+  if(p->uframe)
     kfree((void*)p->uframe);
-  }
   p->uframe = 0;
   if(p->pagetable)
     proc_freepagetable(p->pagetable, p->sz);
   p->pagetable = 0;
   p->sz = 0;
+  if(p->vmas)
+    kfree((void*)p->vmas);
+  p->vmas = 0;
+  p->nvma = 0;
+  p->vmahint = 0;
   p->pid = 0;
   p->parent = 0;
   p->name[0] = 0;
   p->chan = 0;
   p->killed = 0;
+  p->kfn = 0;
   p->xstate = 0;
   p->state = UNUSED;
   p->tracemask = 0;
@@ -274,21 +275,61 @@ userinit(void)
   release(&p->lock);
 }
 
+// A kernel thread's very first scheduling by scheduler()
+// will swtch to kthread_entry.
+static void
+kthread_entry(void)
+{
+  struct proc *p = myproc();
+
+  // Still holding p->lock from scheduler.
+  release(&p->lock);
+
+  p->kfn();
+  panic("kthread returned");
+}
+
+// Start a kernel thread that runs fn(), which must not
+// return. The thread has no user memory and never
+// returns to user space; it is a process only so that
+// it can be scheduled and can sleep.
+// Returns its pid, or -1.
+int
+kthread_create(char *name, void (*fn)(void))
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    return -1;
+  p->kfn = fn;
+  p->context.ra = (uint64)kthread_entry;
+  safestrcpy(p->name, name, sizeof(p->name));
+  p->state = RUNNABLE;
+  release(&p->lock);
+  return p->pid;
+}
+
 // Grow or shrink user memory by n bytes.
+// Growing only moves p->sz: the new pages are allocated
+// when first touched, by ldheap(). Shrinking frees the
+// pages that were.
 // Return 0 on success, -1 on failure.
 int
 growproc(int n)
 {
-  uint sz;
+  uint64 sz;
   struct proc *p = myproc();
 
   sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n)) == 0) {
+    if(sz + n > TRAPFRAME || vmaoverlap(PGROUNDUP(sz), sz + n))
       return -1;
-    }
+    sz += n;
   } else if(n < 0){
+    if(sz < -n || uvmsplit(p->pagetable, PGROUNDUP(sz + n)) < 0)
+      return -1;
     sz = uvmdealloc(p->pagetable, sz, sz + n);
+    p->vmahint = 0; // the freed heap is a gap for mmap
   }
   p->sz = sz;
   return 0;
@@ -317,10 +358,10 @@ fork(void)
   np->sz = p->sz;
 
   // copy virtual memory area
-  memmove(np->vma_areas, p->vma_areas, sizeof(p->vma_areas));
-  for (i = 0; i < NVMA; i++) {
-    if (p->vma_areas[i].addr != 0)
-      filedup(p->vma_areas[i].f);
+  if(vmacopy(np, p) < 0){
+    freeproc(np);
+    release(&np->lock);
+    return -1;
   }
 
   // copy saved user registers.
@@ -113,6 +113,8 @@ struct proc {
   int tickspassed;             // Ticks elapsed after last alarm handler
   struct trapframe *alarmfr;   // A scracth frame for sigalarm to save registers
   int alarmlock;               // Indicate an alarm handler is in progress
-  struct vma vma_areas[NVMA];  // Virtual Memory Areas
-  struct spinlock vma_lock;      // Lock for VMA 
+  struct vma **vmas;           // Virtual Memory Areas, sorted by address
+  int nvma;                    // Number of VMAs
+  uint64 vmahint;              // No free page between the heap and here
+  void (*kfn)(void);           // Body of a kernel thread, else 0
 };
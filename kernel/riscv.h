@@ -346,13 +346,20 @@ sfence_vma()
 #define PGROUNDUP(sz)  (((sz)+PGSIZE-1) & ~(PGSIZE-1))
 #define PGROUNDDOWN(a) (((a)) & ~(PGSIZE-1))
 
+#define HPGSIZE (512*PGSIZE) // bytes per huge page, mapped by a megapage
+
+#define HPGROUNDUP(sz)  (((sz)+HPGSIZE-1) & ~(HPGSIZE-1))
+#define HPGROUNDDOWN(a) (((a)) & ~(HPGSIZE-1))
+
 #define PTE_V (1L << 0) // valid
 #define PTE_R (1L << 1)
 #define PTE_W (1L << 2)
 #define PTE_X (1L << 3)
 #define PTE_U (1L << 4) // 1 -> user can access
 #define PTE_A (1L << 6) // access bit
+#define PTE_D (1L << 7) // dirty bit: the page has been written
 #define PTE_C (1L << 8) // 1 -> copy-on-write page 
+#define PTE_H (1L << 9) // 1 -> megapage leaf mapping a user huge page
 
 // shift a physical address to the right place for a PTE.
 #define PA2PTE(pa) ((((uint64)pa) >> 12) << 10)
@@ -361,13 +368,23 @@ sfence_vma()
 
 #define PTE_FLAGS(pte) ((pte) & 0x3FF)
 
+// a valid PTE with none of R, W, X points to the next level
+// of the page table; otherwise it is a leaf.
+#define PTE_LEAF(pte) ((pte) & (PTE_R|PTE_W|PTE_X))
+
 // extract the three 9-bit page table indices from a virtual address.
 #define PXMASK          0x1FF // 9 bits
 #define PXSHIFT(level)  (PGSHIFT+(9*(level)))
 #define PX(level, va) ((((uint64) (va)) >> PXSHIFT(level)) & PXMASK)
 
+// bytes mapped by a leaf PTE at level: a 4096-byte page at
+// level 0, a 2-megabyte megapage at level 1, a 1-gigabyte
+// gigapage at level 2.
+#define LEVELSIZE(level) (1L << PXSHIFT(level))
+
 // extract index of physical address in refcount array
-#define PGREF(pa) (((uint64) pa) / PGSIZE) 
+// (needs memlayout.h for KERNBASE)
+#define PGREF(pa) ((((uint64) pa) - KERNBASE) / PGSIZE)
 
 // one beyond the highest possible virtual address.
 // MAXVA is actually one bit less than the max allowed by
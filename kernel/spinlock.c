@@ -8,12 +8,61 @@
 #include "proc.h"
 #include "defs.h"
 
+#define NLOCK 500
+
+// Registry of initialized locks, so that statslock()
+// can report their contention counters.
+static struct spinlock *locks[NLOCK];
+struct spinlock lock_locks;
+
+// Remove lk from the registry. Must be called before
+// the memory holding a lock is freed.
 void
-initlock(struct spinlock *lk, char *name)
+freelock(struct spinlock *lk)
+{
+  acquire(&lock_locks);
+  for(int i = 0; i < NLOCK; i++) {
+    if(locks[i] == lk) {
+      locks[i] = 0;
+      break;
+    }
+  }
+  release(&lock_locks);
+}
+
+// Record lk in the registry. Locks initialized once the
+// registry is full are still usable, just not reported.
+static void
+findslot(struct spinlock *lk)
+{
+  acquire(&lock_locks);
+  for(int i = 0; i < NLOCK; i++) {
+    if(locks[i] == 0) {
+      locks[i] = lk;
+      break;
+    }
+  }
+  release(&lock_locks);
+}
+
+// Initialize lk without recording it in the registry, for
+// locks that come by the thousand, such as the one inside
+// each sleep lock; they would crowd out the others.
+void
+initlockunreg(struct spinlock *lk, char *name)
 {
   lk->name = name;
   lk->locked = 0;
   lk->cpu = 0;
+  lk->nts = 0;
+  lk->n = 0;
+}
+
+void
+initlock(struct spinlock *lk, char *name)
+{
+  initlockunreg(lk, name);
+  findslot(lk);
 }
 
 // Acquire the lock.
@@ -25,12 +74,15 @@ acquire(struct spinlock *lk)
   if(holding(lk))
     panic("acquire");
 
+  __sync_fetch_and_add(&(lk->n), 1);
+
   // On RISC-V, sync_lock_test_and_set turns into an atomic swap:
   //   a5 = 1
   //   s1 = &lk->locked
   //   amoswap.w.aq a5, a5, (s1)
-  while(__sync_lock_test_and_set(&lk->locked, 1) != 0)
-    ;
+  while(__sync_lock_test_and_set(&lk->locked, 1) != 0) {
+    __sync_fetch_and_add(&(lk->nts), 1);
+  }
 
   // Tell the C compiler and the processor to not move loads or stores
   // past this point, to ensure that the critical section's memory
@@ -108,3 +160,56 @@ pop_off(void)
   if(c->noff == 0 && c->intena)
     intr_on();
 }
+
+static int
+snprint_lock(char *buf, int sz, struct spinlock *lk)
+{
+  int n = 0;
+  if(lk->n > 0) {
+    n = snprintf(buf, sz, "lock: %s: #test-and-set %d #acquire() %d\n",
+                 lk->name, lk->nts, lk->n);
+  }
+  return n;
+}
+
+// Print the contention counters of the allocator and buffer
+// cache locks, followed by the five most contended locks.
+// The final "tot=" line sums the kmem/bcache test-and-set
+// counts, for tests such as kalloctest.
+int
+statslock(char *buf, int sz)
+{
+  int n;
+  int tot = 0;
+
+  acquire(&lock_locks);
+  n = snprintf(buf, sz, "--- lock kmem/bcache stats\n");
+  for(int i = 0; i < NLOCK; i++) {
+    if(locks[i] == 0)
+      continue;
+    if(strncmp(locks[i]->name, "bcache", strlen("bcache")) == 0 ||
+       strncmp(locks[i]->name, "kmem", strlen("kmem")) == 0) {
+      tot += locks[i]->nts;
+      n += snprint_lock(buf+n, sz-n, locks[i]);
+    }
+  }
+
+  n += snprintf(buf+n, sz-n, "--- top 5 contended locks:\n");
+  int last = 0x7fffffff;
+  for(int t = 0; t < 5; t++) {
+    struct spinlock *top = 0;
+    for(int i = 0; i < NLOCK; i++) {
+      if(locks[i] == 0 || locks[i]->nts >= last)
+        continue;
+      if(top == 0 || locks[i]->nts > top->nts)
+        top = locks[i];
+    }
+    if(top == 0)
+      break;
+    n += snprint_lock(buf+n, sz-n, top);
+    last = top->nts;
+  }
+  n += snprintf(buf+n, sz-n, "tot= %d\n", tot);
+  release(&lock_locks);
+  return n;
+}
@@ -5,5 +5,9 @@ struct spinlock {
   // For debugging:
   char *name;        // Name of lock.
   struct cpu *cpu;   // The cpu holding the lock.
+
+  // For contention statistics (see statslock()):
+  int nts;           // # of failed test-and-set attempts
+  int n;             // # of calls to acquire()
 };
 
@@ -0,0 +1,77 @@
+//
+// The statistics device: reading it returns a text
+// report of kernel counters (lock contention, buffer
+// cache hits and misses, commit latency, kernel page
+// table shape, free memory fragmentation, ...).
+// init creates it as /statistics; see user/statistics.c.
+//
+
+#include <stdarg.h>
+
+#include "types.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "riscv.h"
+#include "defs.h"
+
+#define BUFSZ 4096
+static struct {
+  struct spinlock lock;
+  char buf[BUFSZ];
+  int sz;
+  int off;
+} stats;
+
+int
+statswrite(int user_src, uint64 src, int n)
+{
+  return -1;
+}
+
+// A fresh report is generated at the start of each
+// pass; reading past its end returns -1 once and
+// resets for the next reader.
+int
+statsread(int user_dst, uint64 dst, int n)
+{
+  int m;
+
+  acquire(&stats.lock);
+
+  if(stats.sz == 0) {
+    stats.sz = statslock(stats.buf, BUFSZ);
+    stats.sz += statsbcache(stats.buf+stats.sz, BUFSZ-stats.sz);
+    stats.sz += statslog(stats.buf+stats.sz, BUFSZ-stats.sz);
+    stats.sz += statsdcache(stats.buf+stats.sz, BUFSZ-stats.sz);
+    stats.sz += statspcache(stats.buf+stats.sz, BUFSZ-stats.sz);
+    stats.sz += statskvm(stats.buf+stats.sz, BUFSZ-stats.sz);
+    stats.sz += statskalloc(stats.buf+stats.sz, BUFSZ-stats.sz);
+  }
+  m = stats.sz - stats.off;
+
+  if (m > 0) {
+    if(m > n)
+      m = n;
+    if(either_copyout(user_dst, dst, stats.buf+stats.off, m) != -1) {
+      stats.off += m;
+    }
+  } else {
+    m = -1;
+    stats.sz = 0;
+    stats.off = 0;
+  }
+  release(&stats.lock);
+  return m;
+}
+
+void
+statsinit(void)
+{
+  initlock(&stats.lock, "stats");
+
+  devsw[STATS].read = statsread;
+  devsw[STATS].write = statswrite;
+}
@@ -113,6 +113,8 @@ extern uint64 sys_connect(void);
 extern uint64 sys_symlink(void);
 extern uint64 sys_mmap(void);
 extern uint64 sys_munmap(void);
+extern uint64 sys_msync(void);
+extern uint64 sys_madvise(void);
 
 static uint64 (*syscalls[])(void) = {
 [SYS_fork]      sys_fork,
@@ -145,6 +147,8 @@ static uint64 (*syscalls[])(void) = {
 [SYS_symlink]   sys_symlink,
 [SYS_mmap]      sys_mmap,
 [SYS_munmap]    sys_munmap,
+[SYS_msync]     sys_msync,
+[SYS_madvise]   sys_madvise,
 };
 
 static char *syscall_names[] = {
@@ -178,6 +182,8 @@ static char *syscall_names[] = {
   "symlink",
   "mmap",
   "munmap",
+  "msync",
+  "madvise",
 };
 
 void
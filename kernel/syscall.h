@@ -29,3 +29,5 @@
 #define SYS_symlink   28
 #define SYS_mmap      29
 #define SYS_munmap    30
+#define SYS_msync     31
+#define SYS_madvise   32
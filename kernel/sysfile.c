@@ -75,6 +75,10 @@ sys_read(void)
 
   if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argaddr(1, &p) < 0)
     return -1;
+  // copy only into pages that are loaded already: fileread()
+  // copies with pipe, console and inode locks held.
+  if(n > 0 && (n = vmprefault(p, n, 1)) == 0)
+    return -1;
   return fileread(f, p, n);
 }
 
@@ -87,6 +91,9 @@ sys_write(void)
 
   if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argaddr(1, &p) < 0)
     return -1;
+  // as in sys_read().
+  if(n > 0 && (n = vmprefault(p, n, 0)) == 0)
+    return -1;
 
   return filewrite(f, p, n);
 }
@@ -125,16 +132,16 @@ sys_link(void)
   if(argstr(0, old, MAXPATH) < 0 || argstr(1, new, MAXPATH) < 0)
     return -1;
 
-  begin_op();
+  begin_opn(CREATEOPBLOCKS);
   if((ip = namei(old)) == 0){
-    end_op();
+    end_opn(CREATEOPBLOCKS);
     return -1;
   }
 
   ilock(ip);
   if(ip->type == T_DIR){
     iunlockput(ip);
-    end_op();
+    end_opn(CREATEOPBLOCKS);
     return -1;
   }
 
@@ -152,7 +159,7 @@ sys_link(void)
   iunlockput(dp);
   iput(ip);
 
-  end_op();
+  end_opn(CREATEOPBLOCKS);
 
   return 0;
 
@@ -161,7 +168,7 @@ bad:
   ip->nlink--;
   iupdate(ip);
   iunlockput(ip);
-  end_op();
+  end_opn(CREATEOPBLOCKS);
   return -1;
 }
 
@@ -218,6 +225,7 @@ sys_unlink(void)
   memset(&de, 0, sizeof(de));
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("unlink: writei");
+  dcache_forget(dp->dev, dp->inum, name);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -270,19 +278,31 @@ create(char *path, short type, short major, short minor)
   iupdate(ip);
 
   if(type == T_DIR){  // Create . and .. entries.
-    dp->nlink++;  // for ".."
-    iupdate(dp);
     // No ip->nlink++ for ".": avoid cyclic ref count.
     if(dirlink(ip, ".", ip->inum) < 0 || dirlink(ip, "..", dp->inum) < 0)
       panic("create dots");
   }
 
+  // Fails if dp is a hashed directory that cannot grow.
   if(dirlink(dp, name, ip->inum) < 0)
-    panic("create: dirlink");
+    goto fail;
+
+  if(type == T_DIR){
+    dp->nlink++;  // for ".."
+    iupdate(dp);
+  }
 
   iunlockput(dp);
 
   return ip;
+
+fail:
+  // de-allocate ip.
+  ip->nlink = 0;
+  iupdate(ip);
+  iunlockput(ip);
+  iunlockput(dp);
+  return 0;
 }
 
 uint64
@@ -292,28 +312,29 @@ sys_open(void)
   int fd, omode;
   struct file *f;
   struct inode *ip;
-  int n;
+  int n, nblk;
 
   if((n = argstr(0, path, MAXPATH)) < 0 || argint(1, &omode) < 0)
     return -1;
 
-  begin_op();
+  nblk = (omode & O_CREATE) ? CREATEOPBLOCKS : MAXOPBLOCKS;
+  begin_opn(nblk);
 
   if(omode & O_CREATE){
     ip = create(path, T_FILE, 0, 0);
     if(ip == 0){
-      end_op();
+      end_opn(nblk);
       return -1;
     }
   } else {
     if((ip = namei(path)) == 0){
-      end_op();
+      end_opn(nblk);
       return -1;
     }
     ilock(ip);
     if(ip->type == T_DIR && omode != O_RDONLY){
       iunlockput(ip);
-      end_op();
+      end_opn(nblk);
       return -1;
     }
   }
@@ -330,7 +351,7 @@ sys_open(void)
 
       // find new ip 
       if((ip = namei(path)) == 0){
-        end_op();
+        end_opn(nblk);
         return -1;
       }
       ilock(ip);
@@ -339,7 +360,7 @@ sys_open(void)
       // fail if exceed max nested symlink depth
       if (i >= MAXDEPTH) {
         iunlockput(ip);
-        end_op();
+        end_opn(nblk);
         return -1;
       }
     }
@@ -347,7 +368,14 @@ sys_open(void)
 
   if(ip->type == T_DEVICE && (ip->major < 0 || ip->major >= NDEV)){
     iunlockput(ip);
-    end_op();
+    end_opn(nblk);
+    return -1;
+  }
+
+  // a running program's text is the file's cached pages.
+  if((omode & O_TRUNC) && ip->nexec > 0){
+    iunlockput(ip);
+    end_opn(nblk);
     return -1;
   }
 
@@ -355,7 +383,7 @@ sys_open(void)
     if(f)
       fileclose(f);
     iunlockput(ip);
-    end_op();
+    end_opn(nblk);
     return -1;
   }
 
@@ -365,6 +393,9 @@ sys_open(void)
   } else {
     f->type = FD_INODE;
     f->off = 0;
+    f->ranext = 0;
+    f->rablock = 0;
+    f->rawin = 0;
   }
   f->ip = ip;
   f->readable = !(omode & O_WRONLY);
@@ -375,7 +406,7 @@ sys_open(void)
   }
 
   iunlock(ip);
-  end_op();
+  end_opn(nblk);
 
   return fd;
 }
@@ -386,13 +417,13 @@ sys_mkdir(void)
   char path[MAXPATH];
   struct inode *ip;
 
-  begin_op();
+  begin_opn(CREATEOPBLOCKS);
   if(argstr(0, path, MAXPATH) < 0 || (ip = create(path, T_DIR, 0, 0)) == 0){
-    end_op();
+    end_opn(CREATEOPBLOCKS);
     return -1;
   }
   iunlockput(ip);
-  end_op();
+  end_opn(CREATEOPBLOCKS);
   return 0;
 }
 
@@ -403,16 +434,16 @@ sys_mknod(void)
   char path[MAXPATH];
   int major, minor;
 
-  begin_op();
+  begin_opn(CREATEOPBLOCKS);
   if((argstr(0, path, MAXPATH)) < 0 ||
      argint(1, &major) < 0 ||
      argint(2, &minor) < 0 ||
      (ip = create(path, T_DEVICE, major, minor)) == 0){
-    end_op();
+    end_opn(CREATEOPBLOCKS);
     return -1;
   }
   iunlockput(ip);
-  end_op();
+  end_opn(CREATEOPBLOCKS);
   return 0;
 }
 
@@ -553,14 +584,14 @@ sys_symlink(void)
   }
 
   // write target path to file content
-  begin_op();
+  begin_opn(CREATEOPBLOCKS);
   ip = create(path, T_SYMLINK, 0, 0);
 
   if (writei(ip, 0, (uint64)target, 0, MAXPATH) != MAXPATH) {
     panic("symlink: writei");
   }
   iunlockput(ip);
-  end_op();
+  end_opn(CREATEOPBLOCKS);
 
   return 0;
 }
@@ -1,4 +1,6 @@
 struct sysinfo {
   uint64 freemem;   // amount of free memory (bytes)
   uint64 nproc;     // number of process
+  uint64 nhuge;     // number of huge pages in use
+  uint64 freehuge;  // number of free huge pages
 };
@@ -73,8 +73,10 @@ sockalloc(struct file **f, uint32 raddr, uint16 lport, uint16 rport)
   return 0;
 
 bad:
-  if (si)
+  if (si) {
+    freelock(&si->lock);
     kfree((char*)si);
+  }
   if (*f)
     fileclose(*f);
   return -1;
@@ -104,6 +106,7 @@ sockclose(struct sock *si)
     mbuffree(m);
   }
 
+  freelock(&si->lock);
   kfree((char*)si);
 }
 
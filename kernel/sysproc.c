@@ -36,6 +36,10 @@ sys_wait(void)
   uint64 p;
   if(argaddr(0, &p) < 0)
     return -1;
+  // wait() copies the status out holding wait_lock and the
+  // child's lock, so load the page first; see sys_read().
+  if(p != 0 && vmprefault(p, sizeof(int), 1) != sizeof(int))
+    return -1;
   return wait(p);
 }
 
@@ -120,6 +124,7 @@ sys_sysinfo(void)
 
   s.freemem = kgetfree();
   s.nproc = numproc();
+  kgethuge(&s.nhuge, &s.freehuge);
 
   // copy struct sysinfo from kernel to user address
   pagetable_t pagetable = myproc()->pagetable;
@@ -8,6 +8,7 @@
 #include "sleeplock.h"
 #include "fs.h"
 #include "file.h"
+#include "fcntl.h"
 
 struct spinlock tickslock;
 uint ticks;
@@ -20,7 +21,6 @@ void kernelvec();
 extern int devintr();
 
 int cow();
-int ldvma(uint64 va);
 
 void
 trapinit(void)
@@ -238,8 +238,8 @@ devintr()
   }
 }
 
-// handle a page fault from copy-on-write
-// create new page 
+// handle a page fault: load a VMA page that has not been
+// touched yet, or copy a copy-on-write page on a store
 // return -1 if unsuccessful
 int
 cow()
@@ -257,22 +257,38 @@ cow()
   }
 
   va = PGROUNDDOWN(va);
-  if ((pte = walk(p->pagetable, va, 0)) == 0) {
-    printf("page fault: va not in pgtbl\n");
+  pte = walk(p->pagetable, va, 0);
+
+  // not mapped yet: load it if it is in a VMA or the heap
+  if (pte == 0 || (*pte & PTE_V) == 0) {
+    if (ldvma(va) == -1 && ldheap(va, r_scause() == 15) == -1) {
+      printf("faulting virtual address: %p\n", r_stval());
+      printf("Page Fault.\n");
+      p->killed = 1; // kill on actual page fault
+      return -1;
+    }
+    return 0;
+  }
+
+  // mapped: only a store to a copy-on-write page is allowed,
+  // not e.g. one to a read-only text page.
+  if ((*pte & PTE_C) == 0 || r_scause() != 15) {
+    printf("faulting virtual address: %p\n", r_stval());
+    printf("Page Fault.\n");
     p->killed = 1;
     return -1;
   }
 
-  // check if it is not copy-on-write
-  if ((*pte & PTE_C) == 0) {
-    // check if it is not vma loading
-    if (ldvma(va) == -1) {
-      printf("Page Fault.\n");
-      p->killed = 1; // kill on actual page fault
+  // a huge page is made writable, if the process has it to
+  // itself, or else split so the store copies one page.
+  if (*pte & PTE_H) {
+    if (uvmcowhuge(p->pagetable, va) < 0) {
+      p->killed = 1;
       return -1;
-    } else {
-      return 0;
     }
+    pte = walk(p->pagetable, va, 0);
+    if ((*pte & PTE_C) == 0)
+      return 0;
   }
 
   // create new physical page
@@ -281,7 +297,10 @@ cow()
     return -1;
   }
   pa = PTE2PA(*pte);
-  memmove(mem, (char*)pa, PGSIZE);
+  if ((char*)pa == zeropage)
+    memset(mem, 0, PGSIZE);
+  else
+    memmove(mem, (char*)pa, PGSIZE);
 
   // set write permission bits
   flags = PTE_FLAGS(*pte);
@@ -301,53 +320,252 @@ cow()
   return 0;
 }
 
-// load virtual memory area page
-// return -1 if the given virtual address is not in VMA
+// can the aligned 2-megabyte region holding va, which must
+// lie within [lo, hi), be mapped with a huge page? only if
+// nothing in it is mapped yet.
+static int
+hugefits(struct proc *p, uint64 va, uint64 lo, uint64 hi)
+{
+  uint64 a = HPGROUNDDOWN(va);
+  pte_t *pte;
+
+  if (a < lo || a + HPGSIZE > hi)
+    return 0;
+  pte = walklevel(p->pagetable, a, 1, 0);
+  return pte == 0 || (*pte & PTE_V) == 0;
+}
+
+// load a page of heap that sbrk() has grown over but
+// nothing has touched yet: a fresh zeroed page for a store,
+// else the shared zero page, copy-on-write. a store to a
+// whole, aligned 2-megabyte part of the heap gets a zeroed
+// huge page instead, while there are any; a read still
+// shares the zero page.
+// return -1 if the given virtual address is not in the heap
 int
-ldvma(uint64 va)
+ldheap(uint64 va, int write)
 {
   struct proc *p = myproc();
   char *mem;
-  int i;
+  int perm = PTE_V | PTE_U | PTE_R | PTE_X;
+  uint64 a = HPGROUNDDOWN(va);
 
-  // find which VMA 
-  for (i = 0; i < NVMA; i++) {
-    if (p->vma_areas[i].addr == 0) {
+  if (va >= p->sz) {
+    return -1;
+  }
+
+  if (write && hugefits(p, va, 0, p->sz) && !vmaoverlap(a, a + HPGSIZE) &&
+      (mem = khugealloc()) != 0) {
+    memset(mem, 0, HPGSIZE);
+    if (mappages(p->pagetable, a, HPGSIZE, (uint64)mem, perm | PTE_W | PTE_H) == 0)
+      return 0;
+    khugefree(mem);
+  }
+
+  if (write) {
+    if ((mem = kalloc()) == 0) {
+      p->killed = 1;
+      return -1;
+    }
+    memset(mem, 0, PGSIZE);
+    perm |= PTE_W;
+  } else {
+    mem = zeropage;
+    kincref((uint64)mem);
+    perm |= PTE_C;
+  }
+
+  if (mappages(p->pagetable, PGROUNDDOWN(va), PGSIZE, (uint64)mem, perm) != 0) {
+    kfree(mem);
+    p->killed = 1;
+    return -1;
+  }
+  return 0;
+}
+
+#define FAULTAROUND 16  // window of cached pages mapped around a fault
+#define FAULTAHEAD  32  // pages read ahead of a fault in a sequential VMA
+
+// can page a of VMA v be mapped straight from the page
+// cache? only if it is a whole, aligned page of the file.
+// caller holds v->ip->lock.
+static int
+vmacached(struct vma *v, uint64 a)
+{
+  int off = a - v->addr;
+  uint fileoff = v->offset + off;
+
+  return fileoff % PGSIZE == 0 && off + PGSIZE <= v->filelen &&
+         fileoff < v->ip->size;
+}
+
+// map pages of v near uaddr, which just faulted, so that
+// scanning a mapping doesn't trap once per page: the ones
+// already in the page cache in the FAULTAROUND-page window
+// holding uaddr; or, if the process said it will read v
+// sequentially, the next FAULTAHEAD pages, reading them.
+// caller holds v->ip->lock.
+static void
+faultaround(struct proc *p, struct vma *v, uint64 uaddr, int perm)
+{
+  uint64 a, lo, hi;
+  pte_t *pte;
+  char *mem;
+  uint pgno;
+  int fill;
+
+  if (v->advice == MADV_RANDOM)
+    return;
+  fill = v->advice == MADV_SEQUENTIAL;
+  if (fill) {
+    lo = uaddr + PGSIZE;
+    hi = uaddr + FAULTAHEAD*PGSIZE;
+  } else {
+    lo = uaddr & ~((uint64)FAULTAROUND*PGSIZE - 1);
+    hi = lo + FAULTAROUND*PGSIZE;
+  }
+  if (lo < v->addr)
+    lo = v->addr;
+  if (hi > v->addr + v->length)
+    hi = v->addr + v->length;
+  if (fill && lo < hi)
+    ireadahead(v->ip, (v->offset + (lo - v->addr)) / BSIZE, (hi - lo) / BSIZE);
+
+  for (a = lo; a < hi; a += PGSIZE) {
+    if (a == uaddr || !vmacached(v, a))
+      continue;
+    pte = walk(p->pagetable, a, 0);
+    if (pte && (*pte & PTE_V))
+      continue;
+    pgno = (v->offset + (a - v->addr)) / PGSIZE;
+    if (fill)
+      mem = igetpage(v->ip, pgno);
+    else
+      mem = pcache_lookup(v->ip->dev, v->ip->inum, pgno);
+    if (mem == 0) {
+      if (fill)
+        break; // out of memory
       continue;
     }
-    if (va >= p->vma_areas[i].addr && va < p->vma_areas[i].addr + p->vma_areas[i].length) {
+    if (mappages(p->pagetable, a, PGSIZE, (uint64)mem, perm) != 0) {
+      kfree(mem);
       break;
     }
   }
+}
+
+// map the aligned 2-megabyte region at a of private VMA v
+// with a huge page of its own, filled from the file.
+// return -1 if there is no free huge page.
+static int
+ldhuge(struct proc *p, struct vma *v, uint64 a, int perm)
+{
+  char *mem;
+  int off = a - v->addr;
+  int n;
 
-  // va not in any VMA
-  if (i == NVMA) {
-    printf("faulting virtual address: %p\n", va);
+  if ((mem = khugealloc()) == 0)
     return -1;
+  n = 0;
+  if (off < v->filelen) {
+    n = v->filelen - off < HPGSIZE ? v->filelen - off : HPGSIZE;
+    ilock(v->ip);
+    n = readi(v->ip, 0, (uint64)mem, v->offset + off, n);
+    iunlock(v->ip);
+    if (n < 0)
+      n = 0;
   }
+  memset(mem + n, 0, HPGSIZE - n);
+  if (mappages(p->pagetable, a, HPGSIZE, (uint64)mem, perm | PTE_H) != 0) {
+    khugefree(mem);
+    return -1;
+  }
+  return 0;
+}
 
-  struct inode *ip = p->vma_areas[i].f->ip;
-  int off = p->vma_areas[i].offset;
-  uint64 addr = p->vma_areas[i].addr;
-  uint64 uaddr = PGROUNDDOWN(va);
-  int perm = PTE_V | PTE_U | p->vma_areas[i].perm << 1;
+// load virtual memory area page
+// return -1 if the given virtual address is not in VMA, or,
+// killing the process, if out of memory
+int
+ldvma(uint64 va)
+{
+  struct vma *v;
 
-  // create physical page
-  if ((mem = kalloc()) == 0) {
-    p->killed = 1;
+  // find which VMA 
+  if ((v = vmalookup(va)) == 0) {
+    return -1;
+  }
+  if (vmaload(v, va) < 0) {
+    myproc()->killed = 1;
     return -1;
   }
+  return 0;
+}
+
+// load the page of VMA v holding va
+// return -1 if out of memory
+int
+vmaload(struct vma *v, uint64 va)
+{
+  struct proc *p = myproc();
+  char *mem;
+  int n, cached;
 
-  // create new mapping
-  if (mappages(p->pagetable, uaddr, PGSIZE, (uint64)mem, perm) != 0) {
-    panic("Create VMA mapping failed");
+  struct inode *ip = v->ip;
+  uint64 uaddr = PGROUNDDOWN(va);
+  int off = uaddr - v->addr; // offset of the page in the VMA
+  uint fileoff = v->offset + off;
+  int perm = PTE_V | PTE_U | v->perm << 1;
+  int cperm = perm; // for pages of the page cache
+
+  // shared mappings store into the page cache's pages
+  // directly, writable private ones get a copy at their
+  // first store, and read-only ones, like program text,
+  // share them.
+  if (!(v->flags & MAP_SHARED) && (perm & PTE_W))
+    cperm = (perm & ~PTE_W) | PTE_C;
+
+  // a whole, aligned 2-megabyte part of a writable private
+  // mapping gets a huge page, if there is one free: it
+  // would get copies of the pages at its first stores anyway.
+  if (!(v->flags & MAP_SHARED) && (perm & PTE_W) &&
+      hugefits(p, va, v->addr, v->addr + v->length) &&
+      ldhuge(p, v, HPGROUNDDOWN(va), perm) == 0)
+    return 0;
+
+  if (off >= v->filelen) {
+    // past the part backed by the file, e.g. a program's bss
+    if ((mem = kalloc()) == 0)
+      return -1;
+    memset(mem, 0, PGSIZE);
+    if (mappages(p->pagetable, uaddr, PGSIZE, (uint64)mem, perm) != 0) {
+      kfree(mem);
+      return -1;
+    }
+    return 0;
   }
 
-  // load file content into user address
-  int fileoff = (va - addr) + off;
+  // the caller holds no locks: a system call's buffer is
+  // loaded by vmprefault() before the call takes any.
   ilock(ip);
-  int n = readi(ip, 1, uaddr, fileoff, PGSIZE);
+  cached = vmacached(v, uaddr);
+  if (cached) {
+    mem = igetpage(ip, fileoff / PGSIZE);
+  } else if ((mem = kalloc()) != 0) {
+    // an unaligned offset, or a page that is partly
+    // past the file's part: a private page.
+    n = v->filelen - off < PGSIZE ? v->filelen - off : PGSIZE;
+    n = readi(ip, 0, (uint64)mem, fileoff, n);
+    memset(mem + n, 0, PGSIZE - n);
+  }
+  if (mem == 0 ||
+      mappages(p->pagetable, uaddr, PGSIZE, (uint64)mem, cached ? cperm : perm) != 0) {
+    iunlock(ip);
+    if (mem)
+      kfree(mem);
+    return -1;
+  }
+  faultaround(p, v, uaddr, cperm);
   iunlock(ip);
-  memset(mem + n, 0, PGSIZE - n);
   return 0;
 }
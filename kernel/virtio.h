@@ -45,7 +45,10 @@
 
 // this many virtio descriptors.
 // must be a power of two.
-#define NUM 8
+#define NUM 64
+
+// max data descriptors (blocks) in one request.
+#define MAXSEG 16
 
 // a single descriptor, from the spec.
 struct virtq_desc {
@@ -22,10 +22,10 @@
 
 static struct disk {
   // the virtio driver and device mostly communicate through a set of
-  // structures in RAM. pages[] allocates that memory. pages[] is a
-  // global (instead of calls to kalloc()) because it must consist of
-  // two contiguous pages of page-aligned physical memory.
-  char pages[2*PGSIZE];
+  // structures in RAM. pages[] is that memory, which must consist
+  // of two contiguous pages of page-aligned physical memory, so it
+  // comes from allocpages(1) rather than kalloc().
+  char *pages;
 
   // pages[] is divided into three regions (descriptors, avail, and
   // used), as explained in Section 2.6 of the virtio specification
@@ -56,13 +56,16 @@ static struct disk {
   // our own book-keeping.
   char free[NUM];  // is a descriptor free?
   uint16 used_idx; // we've looked this far in used[2..NUM].
+  int unkicked;    // requests in avail[] the device hasn't been told about.
 
   // track info about in-flight operations,
   // for use when completion interrupt arrives.
   // indexed by first descriptor index of chain.
   struct {
-    struct buf *b;
+    struct buf *b[MAXSEG];  // the request's bufs, in block order
+    int n;
     char status;
+    char async;  // no one will wait; pass b to breaddone()
   } info[NUM];
 
   // disk command headers.
@@ -71,7 +74,7 @@ static struct disk {
   
   struct spinlock vdisk_lock;
   
-} __attribute__ ((aligned (PGSIZE))) disk;
+} disk;
 
 void
 virtio_disk_init(void)
@@ -122,7 +125,9 @@ virtio_disk_init(void)
   if(max < NUM)
     panic("virtio disk max queue too short");
   *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
-  memset(disk.pages, 0, sizeof(disk.pages));
+  if((disk.pages = allocpages(1)) == 0)
+    panic("virtio disk pages");
+  memset(disk.pages, 0, 2*PGSIZE);
   *R(VIRTIO_MMIO_QUEUE_PFN) = ((uint64)disk.pages) >> PGSHIFT;
 
   // desc = pages -- num * virtq_desc
@@ -184,12 +189,11 @@ free_chain(int i)
   }
 }
 
-// allocate three descriptors (they need not be contiguous).
-// disk transfers always use three descriptors.
+// allocate n descriptors (they need not be contiguous).
 static int
-alloc3_desc(int *idx)
+alloc_descs(int *idx, int n)
 {
-  for(int i = 0; i < 3; i++){
+  for(int i = 0; i < n; i++){
     idx[i] = alloc_desc();
     if(idx[i] < 0){
       for(int j = 0; j < i; j++)
@@ -200,27 +204,24 @@ alloc3_desc(int *idx)
   return 0;
 }
 
-void
-virtio_disk_rw(struct buf *b, int write)
+// fill in the n+2 descriptors idx[] for a transfer of the
+// n consecutive blocks in b[], and add the chain to the
+// avail ring. the device is not told about it until
+// virtio_disk_kick().
+// caller holds vdisk_lock.
+static void
+queue(struct buf **b, int n, int write, int *idx)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
-
-  acquire(&disk.vdisk_lock);
+  uint64 sector = b[0]->blockno * (BSIZE / 512);
+  int i;
 
   // the spec's Section 5.2 says that legacy block operations use
-  // three descriptors: one for type/reserved/sector, one for the
-  // data, one for a 1-byte status result.
-
-  // allocate the three descriptors.
-  int idx[3];
-  while(1){
-    if(alloc3_desc(idx) == 0) {
-      break;
-    }
-    sleep(&disk.free[0], &disk.vdisk_lock);
-  }
+  // a descriptor for type/reserved/sector, data descriptors, and
+  // one for a 1-byte status result. the data may be spread over
+  // any number of descriptors, so one request can cover a run
+  // of adjacent blocks whose bufs are scattered in memory.
 
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
   struct virtio_blk_req *buf0 = &disk.ops[idx[0]];
@@ -237,46 +238,158 @@ virtio_disk_rw(struct buf *b, int write)
   disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
   disk.desc[idx[0]].next = idx[1];
 
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
-  if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
-  else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
+  for(i = 1; i <= n; i++){
+    disk.desc[idx[i]].addr = (uint64) b[i-1]->data;
+    disk.desc[idx[i]].len = BSIZE;
+    if(write)
+      disk.desc[idx[i]].flags = 0; // device reads b->data
+    else
+      disk.desc[idx[i]].flags = VRING_DESC_F_WRITE; // device writes b->data
+    disk.desc[idx[i]].flags |= VRING_DESC_F_NEXT;
+    disk.desc[idx[i]].next = idx[i+1];
+  }
 
   disk.info[idx[0]].status = 0xff; // device writes 0 on success
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
-
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  disk.desc[idx[n+1]].addr = (uint64) &disk.info[idx[0]].status;
+  disk.desc[idx[n+1]].len = 1;
+  disk.desc[idx[n+1]].flags = VRING_DESC_F_WRITE; // device writes the status
+  disk.desc[idx[n+1]].next = 0;
+
+  // record struct bufs for virtio_disk_intr().
+  for(i = 0; i < n; i++){
+    b[i]->disk = 1;
+    disk.info[idx[0]].b[i] = b[i];
+  }
+  disk.info[idx[0]].n = n;
 
   // tell the device the first index in our chain of descriptors.
   disk.avail->ring[disk.avail->idx % NUM] = idx[0];
 
   __sync_synchronize();
 
-  // tell the device another avail ring entry is available.
+  // another avail ring entry is available.
   disk.avail->idx += 1; // not % NUM ...
+  disk.unkicked++;
+}
+
+// tell the device about queued requests.
+// caller holds vdisk_lock.
+static void
+kick(void)
+{
+  if(disk.unkicked == 0)
+    return;
 
   __sync_synchronize();
 
   *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
+  disk.unkicked = 0;
+}
+
+// Interface:
+// * virtio_disk_submit() queues a transfer of b without
+//     starting it; submit a batch, then virtio_disk_kick()
+//     to start them all with a single notification.
+// * virtio_disk_submitv() queues a transfer of n bufs holding
+//     consecutive blocks, as few multi-block requests.
+// * virtio_disk_wait(b) kicks the queue if needed and
+//     sleeps until b's transfer has completed.
+// * virtio_disk_rw() does all three for a single buf.
+// * b must stay locked until its transfer completes.
+
+void
+virtio_disk_submitv(struct buf **b, int n, int write)
+{
+  int idx[MAXSEG+2];
+
+  for(int i = 1; i < n; i++)
+    if(b[i]->dev != b[0]->dev || b[i]->blockno != b[0]->blockno + i)
+      panic("virtio_disk_submitv");
+
+  acquire(&disk.vdisk_lock);
+  while(n > 0){
+    int m = n < MAXSEG ? n : MAXSEG;
+
+    // allocate the descriptors. if too few are free,
+    // start the requests we've queued, so that some
+    // of them complete and free up descriptors.
+    while(alloc_descs(idx, m+2) < 0){
+      kick();
+      sleep(&disk.free[0], &disk.vdisk_lock);
+    }
+
+    disk.info[idx[0]].async = 0;
+    queue(b, m, write, idx);
+    b += m;
+    n -= m;
+  }
+  release(&disk.vdisk_lock);
+}
+
+void
+virtio_disk_submit(struct buf *b, int write)
+{
+  virtio_disk_submitv(&b, 1, write);
+}
+
+void
+virtio_disk_kick(void)
+{
+  acquire(&disk.vdisk_lock);
+  kick();
+  release(&disk.vdisk_lock);
+}
+
+void
+virtio_disk_wait(struct buf *b)
+{
+  acquire(&disk.vdisk_lock);
+  if(b->disk)
+    kick();
 
   // Wait for virtio_disk_intr() to say request has finished.
   while(b->disk == 1) {
     sleep(b, &disk.vdisk_lock);
   }
+  release(&disk.vdisk_lock);
+}
+
+void
+virtio_disk_rw(struct buf *b, int write)
+{
+  virtio_disk_submit(b, write);
+  virtio_disk_wait(b);
+}
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+// queue reads of n bufs holding consecutive blocks, as few
+// multi-block requests, and return without waiting.
+// virtio_disk_intr() passes each buf to breaddone() when its
+// data has arrived. returns how many of the bufs were queued,
+// stopping early if no descriptors are free; read-ahead is
+// only a hint, so the caller should not wait for space.
+int
+virtio_disk_read_async(struct buf **b, int n)
+{
+  int idx[MAXSEG+2], done = 0;
 
+  for(int i = 1; i < n; i++)
+    if(b[i]->dev != b[0]->dev || b[i]->blockno != b[0]->blockno + i)
+      panic("virtio_disk_read_async");
+
+  acquire(&disk.vdisk_lock);
+  while(done < n){
+    int m = n - done < MAXSEG ? n - done : MAXSEG;
+
+    if(alloc_descs(idx, m+2) < 0){
+      kick();
+      break;
+    }
+    disk.info[idx[0]].async = 1;
+    queue(b + done, m, 0, idx);
+    done += m;
+  }
   release(&disk.vdisk_lock);
+  return done;
 }
 
 void
@@ -295,7 +408,8 @@ virtio_disk_intr()
   __sync_synchronize();
 
   // the device increments disk.used->idx when it
-  // adds an entry to the used ring.
+  // adds an entry to the used ring. one interrupt
+  // may report many completed requests.
 
   while(disk.used_idx != disk.used->idx){
     __sync_synchronize();
@@ -304,9 +418,16 @@ virtio_disk_intr()
     if(disk.info[id].status != 0)
       panic("virtio_disk_intr status");
 
-    struct buf *b = disk.info[id].b;
-    b->disk = 0;   // disk is done with buf
-    wakeup(b);
+    free_chain(id);
+    for(int i = 0; i < disk.info[id].n; i++){
+      struct buf *b = disk.info[id].b[i];
+      disk.info[id].b[i] = 0;
+      b->disk = 0;   // disk is done with buf
+      if(disk.info[id].async)
+        breaddone(b);
+      else
+        wakeup(b);
+    }
 
     disk.used_idx += 1;
   }
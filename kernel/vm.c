@@ -47,6 +47,9 @@ kvmmake(void)
   kvmmap(kpgtbl, KERNBASE, KERNBASE, (uint64)etext-KERNBASE, PTE_R | PTE_X);
 
   // map kernel data and the physical RAM we'll make use of.
+  // past the first 2-megabyte boundary above etext this is
+  // all megapages, so the kernel's accesses to RAM need few
+  // page-table pages and TLB entries.
   kvmmap(kpgtbl, (uint64)etext, (uint64)etext, PHYSTOP-(uint64)etext, PTE_R | PTE_W);
 
   // map the trampoline for trap entry/exit to
@@ -66,6 +69,36 @@ kvminit(void)
   kernel_pagetable = kvmmake();
 }
 
+// Count the page-table pages of pagetable, and its leaves at
+// each level, into n[0..3]: pages, then leaves at levels 0,
+// 1 and 2.
+static void
+countpt(pagetable_t pagetable, int level, int n[4])
+{
+  n[0]++;
+  for(int i = 0; i < 512; i++){
+    pte_t pte = pagetable[i];
+    if((pte & PTE_V) == 0)
+      continue;
+    if(PTE_LEAF(pte))
+      n[1+level]++;
+    else
+      countpt((pagetable_t)PTE2PA(pte), level-1, n);
+  }
+}
+
+// Print the shape of the kernel page table, for the
+// statistics device.
+int
+statskvm(char *buf, int sz)
+{
+  int n[4] = { 0, 0, 0, 0 };
+
+  countpt(kernel_pagetable, 2, n);
+  return snprintf(buf, sz, "--- kvm: ptpages %d 4K %d 2M %d 1G %d\n",
+                  n[0], n[1], n[2], n[3]);
+}
+
 // Switch h/w page table register to the kernel's page table,
 // and enable paging.
 void
@@ -75,9 +108,11 @@ kvminithart()
   sfence_vma();
 }
 
-// Return the address of the PTE in page table pagetable
-// that corresponds to virtual address va.  If alloc!=0,
-// create any required page-table pages.
+// Return the address of the PTE at the given level of page
+// table pagetable that corresponds to virtual address va.
+// If alloc!=0, create any required page-table pages. If a
+// leaf above that level already maps va (a megapage or a
+// gigapage), return that leaf instead.
 //
 // The risc-v Sv39 scheme has three levels of page-table
 // pages. A page-table page contains 512 64-bit PTEs.
@@ -88,14 +123,16 @@ kvminithart()
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
 pte_t *
-walk(pagetable_t pagetable, uint64 va, int alloc)
+walklevel(pagetable_t pagetable, uint64 va, int level, int alloc)
 {
   if(va >= MAXVA)
     panic("walk");
 
-  for(int level = 2; level > 0; level--) {
-    pte_t *pte = &pagetable[PX(level, va)];
+  for(int l = 2; l > level; l--) {
+    pte_t *pte = &pagetable[PX(l, va)];
     if(*pte & PTE_V) {
+      if(PTE_LEAF(*pte))
+        return pte;
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
       if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
@@ -104,7 +141,15 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
-  return &pagetable[PX(0, va)];
+  return &pagetable[PX(level, va)];
+}
+
+// Return the address of the leaf PTE that maps va, or of
+// the level-0 PTE that would map it.
+pte_t *
+walk(pagetable_t pagetable, uint64 va, int alloc)
+{
+  return walklevel(pagetable, va, 0, alloc);
 }
 
 // Look up a virtual address, return the physical address,
@@ -127,9 +172,64 @@ walkaddr(pagetable_t pagetable, uint64 va)
   if((*pte & PTE_U) == 0)
     return 0;
   pa = PTE2PA(*pte);
+  if(*pte & PTE_H)
+    pa += PGROUNDDOWN(va) % HPGSIZE;
   return pa;
 }
 
+// Load the page at va if it belongs to a VMA or the heap of
+// the current process but has not been touched yet, as when
+// a system call is passed a pointer into a program's data.
+// write says whether the kernel will store to the page.
+// Loading a VMA's page may sleep, reading the file, so it
+// is refused while the caller holds a spinlock, as
+// piperead() does; see vmprefault().
+// Return the page's physical address, or 0.
+uint64
+vmfault(pagetable_t pagetable, uint64 va, int write)
+{
+  struct proc *p = myproc();
+  pte_t *pte;
+  int locked;
+
+  if(va >= MAXVA || p == 0 || pagetable != p->pagetable)
+    return 0;
+  pte = walk(pagetable, va, 0);
+  if(pte && (*pte & PTE_V))
+    return 0; // mapped, but not for the user
+  push_off();
+  locked = mycpu()->noff > 1;
+  pop_off();
+  if(locked){
+    if(vmalookup(va) != 0 || ldheap(va, write) < 0)
+      return 0;
+  } else if(ldvma(va) < 0 && ldheap(va, write) < 0)
+    return 0;
+  return walkaddr(pagetable, va);
+}
+
+// Load the untouched pages of the n bytes of user memory at
+// va, before a system call takes any lock and copies to or
+// from them: loading a VMA's page sleeps and locks its
+// inode, which must not happen under a spinlock, nor under
+// another inode's lock, which could deadlock.
+// Return how many of the bytes can be copied, which is
+// fewer than n if a page is not the process's memory.
+int
+vmprefault(uint64 va, int n, int write)
+{
+  pagetable_t pagetable = myproc()->pagetable;
+  uint64 a;
+
+  if(n <= 0)
+    return n;
+  for(a = PGROUNDDOWN(va); a < va + n; a += PGSIZE){
+    if(walkaddr(pagetable, a) == 0 && vmfault(pagetable, a, write) == 0)
+      return a > va ? a - va : 0;
+  }
+  return n;
+}
+
 // add a mapping to the kernel page table.
 // only used when booting.
 // does not flush TLB or enable paging.
@@ -144,11 +244,18 @@ kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 // physical addresses starting at pa. va and size might not
 // be page-aligned. Returns 0 on success, -1 if walk() couldn't
 // allocate a needed page-table page.
+// Kernel mappings (no PTE_U) use the largest leaf that fits
+// the alignment of va and pa and the size left, so the direct
+// map of RAM takes megapages. User memory is mapped a page
+// at a time, except huge pages: with PTE_H in perm, va, pa
+// and size must be multiples of HPGSIZE, and each megapage
+// maps one huge page.
 int
 mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 {
   uint64 a, last;
   pte_t *pte;
+  int level;
 
   if(size == 0)
     panic("mappages: size");
@@ -156,21 +263,33 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   a = PGROUNDDOWN(va);
   last = PGROUNDDOWN(va + size - 1);
   for(;;){
-    if((pte = walk(pagetable, a, 1)) == 0)
+    level = 0;
+    if(perm & PTE_H){
+      if(a % HPGSIZE || pa % HPGSIZE || (last - a) % HPGSIZE != HPGSIZE - PGSIZE)
+        panic("mappages: huge");
+      level = 1;
+    }
+    while((perm & PTE_U) == 0 && level < 2 &&
+          a % LEVELSIZE(level+1) == 0 && pa % LEVELSIZE(level+1) == 0 &&
+          last - a >= LEVELSIZE(level+1) - PGSIZE)
+      level++;
+    if((pte = walklevel(pagetable, a, level, 1)) == 0)
       return -1;
     if(*pte & PTE_V)
       panic("mappages: remap");
     *pte = PA2PTE(pa) | perm | PTE_V;
-    if(a == last)
+    if(last - a < LEVELSIZE(level))
       break;
-    a += PGSIZE;
-    pa += PGSIZE;
+    a += LEVELSIZE(level);
+    pa += LEVELSIZE(level);
   }
   return 0;
 }
 
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
+// page-aligned. Pages of a VMA that were never touched have
+// no mapping, and are skipped. A huge page must be unmapped
+// whole, or split first with uvmsplit().
 // Optionally free the physical memory.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
@@ -182,12 +301,19 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
     panic("uvmunmap: not aligned");
 
   for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
-    if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+    if((pte = walk(pagetable, a, 0)) == 0 || (*pte & PTE_V) == 0)
+      continue;
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
+    if(*pte & PTE_H){
+      if(a % HPGSIZE || a + HPGSIZE > va + npages*PGSIZE)
+        panic("uvmunmap: part of a huge page");
+      if(do_free)
+        khugefree((void*)PTE2PA(*pte));
+      *pte = 0;
+      a += HPGSIZE - PGSIZE;
+      continue;
+    }
     if(do_free){
       uint64 pa = PTE2PA(*pte);
       kfree((void*)pa);
@@ -196,6 +322,67 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
   }
 }
 
+// Turn the megapage mapping a huge page at *pte into a
+// page-table page of page mappings, with the same flags.
+// The pages' references carry over. Returns -1 if out of
+// memory.
+static int
+splithuge(pte_t *pte)
+{
+  pagetable_t pt;
+  uint64 pa = PTE2PA(*pte);
+  uint flags = PTE_FLAGS(*pte) & ~PTE_H;
+
+  if((pt = (pagetable_t)kalloc()) == 0)
+    return -1;
+  for(int i = 0; i < 512; i++)
+    pt[i] = PA2PTE(pa + i*PGSIZE) | flags;
+  *pte = PA2PTE(pt) | PTE_V;
+  sfence_vma();
+  return 0;
+}
+
+// If va falls inside a huge page, rather than at its start,
+// split its megapage into page mappings, so that va can be
+// the edge of a range to unmap. Returns -1 if out of memory.
+int
+uvmsplit(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+
+  if(va % HPGSIZE == 0 || va >= MAXVA)
+    return 0;
+  pte = walk(pagetable, va, 0);
+  if(pte == 0 || (*pte & (PTE_V|PTE_H)) != (PTE_V|PTE_H))
+    return 0;
+  return splithuge(pte);
+}
+
+// Handle a store to the copy-on-write huge page holding va.
+// If no other process shares any of its pages, just make it
+// writable; otherwise split it, so that the store copies
+// only the page it hits. Returns -1 if out of memory.
+int
+uvmcowhuge(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa, i;
+
+  pte = walk(pagetable, va, 0);
+  if(pte == 0 || (*pte & (PTE_V|PTE_H|PTE_C)) != (PTE_V|PTE_H|PTE_C))
+    panic("uvmcowhuge");
+  pa = PTE2PA(*pte);
+  for(i = 0; i < HPGSIZE; i += PGSIZE)
+    if(kgetref(pa + i) != 1)
+      break;
+  if(i == HPGSIZE){
+    *pte = (*pte & ~PTE_C) | PTE_W;
+    sfence_vma();
+    return 0;
+  }
+  return splithuge(pte);
+}
+
 // create an empty user page table.
 // returns 0 if out of memory.
 pagetable_t
@@ -227,6 +414,8 @@ uvminit(pagetable_t pagetable, uchar *src, uint sz)
 
 // Allocate PTEs and physical memory to grow process from oldsz to
 // newsz, which need not be page aligned.  Returns new size or 0 on error.
+// Whole, aligned 2-megabyte parts of the new memory get huge
+// pages, while there are any.
 uint64
 uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 {
@@ -238,6 +427,16 @@ uvmalloc(pagetable_t pagetable, uint64 oldsz, uint64 newsz)
 
   oldsz = PGROUNDUP(oldsz);
   for(a = oldsz; a < newsz; a += PGSIZE){
+    if(a % HPGSIZE == 0 && a + HPGSIZE <= newsz && (mem = khugealloc()) != 0){
+      memset(mem, 0, HPGSIZE);
+      if(mappages(pagetable, a, HPGSIZE, (uint64)mem, PTE_W|PTE_X|PTE_R|PTE_U|PTE_H) != 0){
+        khugefree(mem);
+        uvmdealloc(pagetable, a, oldsz);
+        return 0;
+      }
+      a += HPGSIZE - PGSIZE;
+      continue;
+    }
     mem = kalloc();
     if(mem == 0){
       uvmdealloc(pagetable, a, oldsz);
@@ -315,20 +514,33 @@ uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
   uint flags;
 
   for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
-    if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+    // the child loads untouched VMA pages itself.
+    if((pte = walk(old, i, 0)) == 0 || (*pte & PTE_V) == 0)
+      continue;
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
 
-    // clear write bit and set copy-on-write bit
-    flags = flags & (~PTE_W);
-    flags = flags | PTE_C;
+    // clear write bit and set copy-on-write bit;
+    // read-only pages, like program text, are just shared.
+    if(flags & PTE_W){
+      flags = flags & (~PTE_W);
+      flags = flags | PTE_C;
+    }
 
     // set new flags on parents
     *pte = PA2PTE(pa) | flags;
 
+    // a huge page is shared whole, a reference to each
+    // of its pages for the child's megapage.
+    if(flags & PTE_H){
+      for(uint64 a = pa; a < pa + HPGSIZE; a += PGSIZE)
+        kincref(a);
+      if(mappages(new, i, HPGSIZE, pa, flags) != 0)
+        panic("uvmcopy: map child to parent failed");
+      i += HPGSIZE - PGSIZE;
+      continue;
+    }
+
     // increase reference count
     kincref(pa);
 
@@ -365,7 +577,7 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
     pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if(pa0 == 0 && (pa0 = vmfault(pagetable, va0, 1)) == 0)
       return -1;
     n = PGSIZE - (dstva - va0);
     if(n > len)
@@ -375,6 +587,20 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
       panic("copyout: va not in pagetable");
     }
 
+    // a copy-on-write huge page is made writable, or split
+    if ((*pte & (PTE_H|PTE_C)) == (PTE_H|PTE_C)) {
+      if (uvmcowhuge(pagetable, va0) < 0) {
+        myproc()->killed = 1;
+        return -1;
+      }
+      pte = walk(pagetable, va0, 0);
+    }
+
+    // a read-only page, e.g. program text shared with
+    // the page cache
+    if ((*pte & (PTE_W|PTE_C)) == 0)
+      return -1;
+
     // handle COW page
     if ((*pte & PTE_C) != 0) {
       char *mem;
@@ -405,6 +631,9 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
       memmove((void *)((uint64)mem + (dstva - va0)), src, n);
     } else {
       memmove((void *)(pa0 + (dstva - va0)), src, n);
+      // the hardware only marks pages the process itself
+      // stores to; vmawriteback() must see this store too.
+      *pte |= PTE_A | PTE_D;
     }
 
     len -= n;
@@ -425,7 +654,7 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
     pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if(pa0 == 0 && (pa0 = vmfault(pagetable, va0, 0)) == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
     if(n > len)
@@ -452,7 +681,7 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
     pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if(pa0 == 0 && (pa0 = vmfault(pagetable, va0, 0)) == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
     if(n > max)
@@ -491,7 +720,7 @@ void vmprint_recursive(pagetable_t pagetable, int level, int max_level) {
             uint64 child = PTE2PA(pte);
             printf("%s%d: pte %p pa %p\n", indents[level], i, pte, child);
             
-            if (level < max_level) {
+            if (level < max_level && !PTE_LEAF(pte)) {
                 vmprint_recursive((pagetable_t)child, level + 1, max_level);
             }
         }
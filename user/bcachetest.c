@@ -0,0 +1,213 @@
+//
+// stress test for the hashed buffer cache.
+// run with several CPUs (make CPUS=8 qemu).
+//
+
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fs.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+#define NCHILD 4
+#define NROUND 200
+#define NBLOCK 4
+#define SZ 4096
+
+void test0(void);
+void test1(void);
+char buf[SZ];
+
+int
+main(int argc, char *argv[])
+{
+  test0();
+  test1();
+  exit(0);
+}
+
+// return the total test-and-set count of the
+// kmem and bcache locks, from the statistics report.
+int
+ntas(int print)
+{
+  int n;
+  char *c;
+
+  memset(buf, 0, sizeof(buf));
+  if (statistics(buf, SZ-1) <= 0) {
+    fprintf(2, "ntas: no stats\n");
+  }
+  n = 0;
+  for(c = buf; *c; c++){
+    if(memcmp(c, "tot= ", 5) == 0){
+      n = atoi(c+5);
+      break;
+    }
+  }
+  if(print)
+    printf("%s", buf);
+  return n;
+}
+
+void
+createfile(char *name, int nblock)
+{
+  char b[BSIZE];
+  int fd;
+
+  fd = open(name, O_CREATE | O_RDWR);
+  if(fd < 0){
+    printf("create %s failed\n", name);
+    exit(-1);
+  }
+  for(int i = 0; i < nblock; i++){
+    memset(b, 0, BSIZE);
+    *(int*)b = i;
+    if(write(fd, b, BSIZE) != BSIZE){
+      printf("write %s failed\n", name);
+      exit(-1);
+    }
+  }
+  close(fd);
+}
+
+// check that block i of name holds i.
+void
+readfile(char *name, int nblock)
+{
+  char b[BSIZE];
+  int fd;
+
+  fd = open(name, O_RDONLY);
+  if(fd < 0){
+    printf("open %s failed\n", name);
+    exit(-1);
+  }
+  for(int i = 0; i < nblock; i++){
+    if(read(fd, b, BSIZE) != BSIZE){
+      printf("read %s failed\n", name);
+      exit(-1);
+    }
+    if(*(int*)b != i){
+      printf("read %s block %d: wrong content %d\n", name, i, *(int*)b);
+      exit(-1);
+    }
+  }
+  close(fd);
+}
+
+// NCHILD processes each read their own small file
+// over and over. the blocks stay cached, so with a
+// single cache lock the readers spend their time
+// spinning on it; with per-bucket locks they rarely
+// meet.
+void
+test0(void)
+{
+  char name[3];
+  int n, m, t0;
+
+  name[0] = 'B';
+  name[2] = '\0';
+  for(int i = 0; i < NCHILD; i++){
+    name[1] = '0' + i;
+    unlink(name);
+    createfile(name, NBLOCK);
+  }
+
+  printf("start test0\n");
+  m = ntas(0);
+  t0 = uptime();
+  for(int i = 0; i < NCHILD; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("fork failed");
+      exit(-1);
+    }
+    if(pid == 0){
+      name[1] = '0' + i;
+      for(int r = 0; r < NROUND; r++)
+        readfile(name, NBLOCK);
+      exit(0);
+    }
+  }
+
+  for(int i = 0; i < NCHILD; i++){
+    wait(0);
+  }
+  printf("test0 results (%d ticks):\n", uptime() - t0);
+  n = ntas(1);
+  if(n-m < 500)
+    printf("test0 OK\n");
+  else
+    printf("test0 FAIL: %d test-and-sets on kmem/bcache locks\n", n-m);
+
+  for(int i = 0; i < NCHILD; i++){
+    name[1] = '0' + i;
+    unlink(name);
+  }
+}
+
+// return the value following key in the statistics
+// report, or -1 if it is not there.
+int
+statval(char *key)
+{
+  char *c;
+  int n = strlen(key);
+
+  memset(buf, 0, sizeof(buf));
+  if (statistics(buf, SZ-1) <= 0) {
+    fprintf(2, "statval: no stats\n");
+  }
+  for(c = buf; *c; c++){
+    if(memcmp(c, key, n) == 0)
+      return atoi(c+n);
+  }
+  return -1;
+}
+
+// use up all of memory, so that kalloc must take
+// pages back from the buffer cache, then give it
+// back. cached file contents must survive, and the
+// cache must grow again afterwards.
+void
+test1(void)
+{
+  int nblock = 200;
+  int nbuf0, nbuf1, nbuf2;
+  char *sz0;
+
+  printf("start test1\n");
+  unlink("bigB");
+  createfile("bigB", nblock);
+  readfile("bigB", nblock);
+  nbuf0 = statval("nbuf ");
+
+  sz0 = sbrk(0);
+  while(1){
+    char *a = sbrk(4096);
+    if(a == (char*)-1)
+      break;
+    a[4095] = 1;
+  }
+  nbuf1 = statval("nbuf ");
+  sbrk(-(sbrk(0) - sz0));
+
+  readfile("bigB", nblock);
+  nbuf2 = statval("nbuf ");
+  unlink("bigB");
+  printf("nbuf: %d at start, %d under pressure, %d after\n",
+         nbuf0, nbuf1, nbuf2);
+  if(nbuf1 >= nbuf0){
+    printf("test1 FAIL: cache did not shrink\n");
+    exit(-1);
+  }
+  if(nbuf2 <= nbuf1){
+    printf("test1 FAIL: cache did not grow back\n");
+    exit(-1);
+  }
+  printf("test1 OK\n");
+}
@@ -0,0 +1,96 @@
+//
+// large directory benchmark, for hashed directories.
+// makes n (default 10000) entries in one directory,
+// looks each of them up, then unlinks them, reporting
+// ticks for each phase. the entries are hard links to
+// a single file, so the test needs only a few inodes.
+//
+// usage: dirbench [n]
+//
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+#define DIR "db.dir"
+
+char path[32];
+
+// set path to DIR/e<i>.
+char*
+entry(int i)
+{
+  char num[12];
+  int n = 0;
+
+  do {
+    num[n++] = '0' + i % 10;
+    i /= 10;
+  } while(i > 0);
+  strcpy(path, DIR "/e");
+  char *p = path + strlen(path);
+  while(n > 0)
+    *p++ = num[--n];
+  *p = 0;
+  return path;
+}
+
+void
+fail(char *what, int i)
+{
+  printf("dirbench: %s %s failed\n", what, entry(i));
+  exit(-1);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int fd, t0, n = 10000;
+
+  if(argc > 1)
+    n = atoi(argv[1]);
+  if(n <= 0){
+    fprintf(2, "usage: dirbench [n]\n");
+    exit(1);
+  }
+
+  if(mkdir(DIR) < 0){
+    printf("dirbench: cannot mkdir %s\n", DIR);
+    exit(-1);
+  }
+  fd = open(DIR "/target", O_CREATE | O_WRONLY);
+  if(fd < 0){
+    printf("dirbench: cannot create %s/target\n", DIR);
+    exit(-1);
+  }
+  close(fd);
+
+  t0 = uptime();
+  for(int i = 0; i < n; i++)
+    if(link(DIR "/target", entry(i)) < 0)
+      fail("link", i);
+  printf("create %d: %d ticks\n", n, uptime() - t0);
+
+  t0 = uptime();
+  for(int i = 0; i < n; i++){
+    if((fd = open(entry(i), O_RDONLY)) < 0)
+      fail("open", i);
+    close(fd);
+  }
+  if((fd = open(entry(n), O_RDONLY)) >= 0)
+    fail("missing open", n);
+  printf("lookup %d: %d ticks\n", n, uptime() - t0);
+
+  t0 = uptime();
+  for(int i = 0; i < n; i++)
+    if(unlink(entry(i)) < 0)
+      fail("unlink", i);
+  printf("unlink %d: %d ticks\n", n, uptime() - t0);
+
+  if(unlink(DIR "/target") < 0 || unlink(DIR) < 0){
+    printf("dirbench: cannot remove %s\n", DIR);
+    exit(-1);
+  }
+  exit(0);
+}
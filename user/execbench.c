@@ -0,0 +1,82 @@
+//
+// exec latency benchmark, for demand-paged exec.
+// runs each of a few programs n (default 100) times
+// the way sh runs a command, fork then exec then wait,
+// reporting ticks for each. the children's input is
+// empty and their output goes nowhere, so the programs
+// do little more than start up and exit.
+//
+// usage: execbench [n]
+//
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+char *progs[] = { "echo", "cat", "wc", "grep", "ls", "sh" };
+
+// run prog once, with no arguments and no input or output.
+// standard input is a pipe whose write end is closed, so a
+// read sees end of file at once; standard output and error
+// are a pipe whose read end is closed, so writes fail.
+// sh, which opens the console for descriptors that are
+// not open, thus exits rather than waiting at its prompt.
+void
+run(char *prog)
+{
+  char *argv[] = { prog, 0 };
+  int pid, xstatus, in[2], out[2];
+
+  if(pipe(in) < 0 || pipe(out) < 0){
+    printf("execbench: pipe failed\n");
+    exit(-1);
+  }
+
+  pid = fork();
+  if(pid < 0){
+    printf("execbench: fork failed\n");
+    exit(-1);
+  }
+  if(pid == 0){
+    close(0);
+    dup(in[0]);
+    close(1);
+    dup(out[1]);
+    close(2);
+    dup(out[1]);
+    close(in[0]);
+    close(in[1]);
+    close(out[0]);
+    close(out[1]);
+    exec(prog, argv);
+    exit(-1);
+  }
+  close(in[0]);
+  close(in[1]);
+  close(out[0]);
+  close(out[1]);
+  wait(&xstatus);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int t0, n = 100;
+
+  if(argc > 1)
+    n = atoi(argv[1]);
+  if(n <= 0){
+    fprintf(2, "usage: execbench [n]\n");
+    exit(1);
+  }
+
+  for(int i = 0; i < sizeof(progs)/sizeof(progs[0]); i++){
+    // the first run may read the program from disk.
+    run(progs[i]);
+    t0 = uptime();
+    for(int j = 0; j < n; j++)
+      run(progs[i]);
+    printf("%s %d: %d ticks\n", progs[i], n, uptime() - t0);
+  }
+  exit(0);
+}
@@ -0,0 +1,85 @@
+//
+// fork-storm benchmark: a process with a large
+// address space forks repeatedly. every fork shares
+// all parent pages copy-on-write, taking one page
+// reference per page, so the cost of fork is
+// dominated by reference counting.
+//
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+#define MB (1024*1024)
+#define SZ (64*MB)
+#define NFORK 20
+#define NCHILD 4
+
+char buf[4096];
+
+// total test-and-set count of the kmem/bcache locks.
+int
+ntas(void)
+{
+  char *c;
+
+  memset(buf, 0, sizeof(buf));
+  statistics(buf, sizeof(buf)-1);
+  for(c = buf; *c; c++){
+    if(memcmp(c, "tot= ", 5) == 0)
+      return atoi(c+5);
+  }
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  char *p, *q;
+  int i, j, t0, m;
+
+  p = sbrk(SZ);
+  if(p == (char*)0xffffffffffffffffL){
+    printf("forkstorm: sbrk(%d) failed\n", SZ);
+    exit(1);
+  }
+  for(q = p; q < p + SZ; q += PGSIZE)
+    *(int*)q = 1;
+
+  printf("forkstorm: %d x %d forks of a %d MB parent\n",
+         NCHILD, NFORK, SZ / MB);
+  m = ntas();
+  t0 = uptime();
+
+  // NCHILD forkers run in parallel, each forking and
+  // reaping NFORK children that touch one page and exit.
+  for(i = 0; i < NCHILD; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("forkstorm: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      for(j = 0; j < NFORK; j++){
+        int pid1 = fork();
+        if(pid1 < 0){
+          printf("forkstorm: fork failed\n");
+          exit(1);
+        }
+        if(pid1 == 0){
+          p[j * PGSIZE] = j;
+          exit(0);
+        }
+        wait(0);
+      }
+      exit(0);
+    }
+  }
+  for(i = 0; i < NCHILD; i++)
+    wait(0);
+
+  printf("forkstorm: %d ticks, %d kmem/bcache test-and-sets\n",
+         uptime() - t0, ntas() - m);
+  exit(0);
+}
@@ -0,0 +1,113 @@
+//
+// huge page benchmark, for transparent huge pages.
+// makes two heap arrays of mb megabytes (default 16): one
+// sbrk()ed whole at a 2-megabyte boundary, which the kernel
+// backs with huge pages, and one grown and touched a page
+// at a time, which gets ordinary pages. then reads one word
+// of every page of each, rounds times (default 50), so that
+// nearly every access is a TLB miss unless the array is
+// mapped with megapages. reports ticks for each, and the
+// huge page counts from sysinfo().
+//
+// usage: hugebench [mb [rounds]]
+//
+
+#include "kernel/types.h"
+#include "kernel/riscv.h"
+#include "kernel/sysinfo.h"
+#include "user/user.h"
+
+int mb = 16;
+int rounds = 50;
+int sink;  // keeps the scans from being optimized away
+
+void
+err(char *why)
+{
+  printf("hugebench: %s failed\n", why);
+  exit(1);
+}
+
+void
+report(char *what)
+{
+  struct sysinfo info;
+
+  if(sysinfo(&info) < 0)
+    err("sysinfo");
+  printf("%s: %d huge pages in use, %d free\n", what,
+         (int)info.nhuge, (int)info.freehuge);
+}
+
+// an array whose whole 2-megabyte parts the kernel can
+// map with huge pages at their first touch.
+char *
+hugearray(int n)
+{
+  uint64 cur = (uint64)sbrk(0);
+
+  if(sbrk(HPGROUNDUP(cur) - cur) == (char*)-1)
+    err("sbrk");
+  return sbrk(n);
+}
+
+// an array of ordinary pages: each page is touched while
+// it is the last page of the heap.
+char *
+smallarray(int n)
+{
+  char *a = sbrk(0);
+
+  for(int i = 0; i < n; i += PGSIZE){
+    if(sbrk(PGSIZE) == (char*)-1)
+      err("sbrk");
+    a[i] = 1;
+  }
+  return a;
+}
+
+int
+scan(char *a, int n)
+{
+  int sum = 0;
+
+  for(int r = 0; r < rounds; r++)
+    for(int i = (r * 64) % PGSIZE; i < n; i += PGSIZE)
+      sum += a[i];
+  return sum;
+}
+
+int
+main(int argc, char *argv[])
+{
+  char *h, *s;
+  int n, t0;
+
+  if(argc > 1)
+    mb = atoi(argv[1]);
+  if(argc > 2)
+    rounds = atoi(argv[2]);
+  if(mb <= 0 || rounds <= 0){
+    fprintf(2, "usage: hugebench [mb [rounds]]\n");
+    exit(1);
+  }
+  n = mb * 1024 * 1024;
+
+  report("before");
+  if((h = hugearray(n)) == (char*)-1)
+    err("sbrk");
+  memset(h, 1, n);
+  s = smallarray(n);
+  memset(s, 1, n);
+  report("after touching");
+
+  t0 = uptime();
+  sink += scan(h, n);
+  printf("huge pages, %d MB x %d: %d ticks\n", mb, rounds, uptime() - t0);
+
+  t0 = uptime();
+  sink += scan(s, n);
+  printf("small pages, %d MB x %d: %d ticks\n", mb, rounds, uptime() - t0);
+
+  exit(0);
+}
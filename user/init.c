@@ -23,6 +23,10 @@ main(void)
   dup(0);  // stdout
   dup(0);  // stderr
 
+  // kernel counters, see user/statistics.c.
+  // fails harmlessly if it already exists.
+  mknod("statistics", STATS, 0);
+
   for(;;){
     printf("init: starting sh\n");
     pid = fork();
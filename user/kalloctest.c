@@ -0,0 +1,179 @@
+//
+// stress test for the per-CPU page allocator.
+// run with several CPUs (make CPUS=8 qemu).
+//
+
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/riscv.h"
+#include "kernel/memlayout.h"
+#include "kernel/sysinfo.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+#define NCHILD 4
+#define N 100000
+#define SZ 4096
+
+void test1(void);
+void test2(void);
+char buf[SZ];
+
+int
+main(int argc, char *argv[])
+{
+  test1();
+  test2();
+  exit(0);
+}
+
+// return the total test-and-set count of the
+// kmem and bcache locks, from the statistics report.
+int
+ntas(int print)
+{
+  int n;
+  char *c;
+
+  memset(buf, 0, sizeof(buf));
+  if (statistics(buf, SZ-1) <= 0) {
+    fprintf(2, "ntas: no stats\n");
+  }
+  n = 0;
+  for(c = buf; *c; c++){
+    if(memcmp(c, "tot= ", 5) == 0){
+      n = atoi(c+5);
+      break;
+    }
+  }
+  if(print)
+    printf("%s", buf);
+  return n;
+}
+
+// NCHILD processes allocate and free a page N times
+// each, on as many CPUs as are available. with a
+// single allocator lock they spend most of their
+// time spinning on it.
+void
+test1(void)
+{
+  void *a, *a1;
+  int n, m, t0;
+
+  printf("start test1\n");
+  m = ntas(0);
+  t0 = uptime();
+  for(int i = 0; i < NCHILD; i++){
+    int pid = fork();
+    if(pid < 0){
+      printf("fork failed");
+      exit(-1);
+    }
+    if(pid == 0){
+      for(i = 0; i < N; i++) {
+        a = sbrk(4096);
+        *(int *)(a+4) = 1;
+        a1 = sbrk(-4096);
+        if (a1 != a + 4096) {
+          printf("wrong sbrk\n");
+          exit(-1);
+        }
+      }
+      exit(0);
+    }
+  }
+
+  for(int i = 0; i < NCHILD; i++){
+    wait(0);
+  }
+  printf("test1 results (%d ticks):\n", uptime() - t0);
+  n = ntas(1);
+  if(n-m < 10)
+    printf("test1 OK\n");
+  else
+    printf("test1 FAIL: %d test-and-sets on kmem/bcache locks\n", n-m);
+}
+
+// count the pages a process can allocate. sbrk() doesn't
+// fail when memory runs out, since pages are allocated
+// when first touched; a child touches pages until it is
+// killed, and reports each one through a pipe.
+int
+countfree()
+{
+  int fds[2];
+  int n = 0;
+  char c;
+  int cc;
+
+  if(pipe(fds) < 0){
+    printf("pipe() failed in countfree()\n");
+    exit(-1);
+  }
+  int pid = fork();
+  if(pid < 0){
+    printf("fork() failed in countfree()\n");
+    exit(-1);
+  }
+  if(pid == 0){
+    close(fds[0]);
+    while(1){
+      uint64 a = (uint64) sbrk(4096);
+      if(a == 0xffffffffffffffff){
+        break;
+      }
+      // modify the memory to make sure it's really allocated.
+      *(char *)(a + 4096 - 1) = 1;
+      if(write(fds[1], "x", 1) != 1){
+        printf("write() failed in countfree()\n");
+        exit(-1);
+      }
+    }
+    exit(0);
+  }
+  close(fds[1]);
+  while((cc = read(fds[0], &c, 1)) == 1)
+    n += 1;
+  if(cc < 0){
+    printf("read() failed in countfree()\n");
+    exit(-1);
+  }
+  close(fds[0]);
+  wait(0);
+  return n;
+}
+
+// free pages end up spread over the CPUs' lists; a
+// process must still be able to allocate all of them
+// (by stealing), and none may be lost.
+void
+test2()
+{
+  struct sysinfo info;
+  int free0 = countfree();
+  int free1;
+
+  printf("start test2\n");
+  if(sysinfo(&info) < 0){
+    printf("test2 FAIL: sysinfo\n");
+    exit(-1);
+  }
+  printf("total free number of pages: %d (out of %d)\n",
+         free0, (int)(info.freemem / PGSIZE));
+  if(info.freemem / PGSIZE - free0 > 100) {
+    printf("test2 FAIL: cannot allocate enough memory\n");
+    exit(-1);
+  }
+  for (int i = 0; i < 50; i++) {
+    free1 = countfree();
+    if(i % 10 == 9)
+      printf(".");
+    if(free1 != free0) {
+      printf("test2 FAIL: losing pages\n");
+      exit(-1);
+    }
+  }
+  printf("\ntest2 OK\n");
+}
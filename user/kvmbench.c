@@ -0,0 +1,79 @@
+//
+// kernel memory-copy benchmark, for the kernel's megapage
+// direct map. reads a file of npages (default 512), small
+// enough to stay in the page cache, rounds times (default
+// 50). each read() is a memmove by the kernel from cached
+// pages spread across RAM into this process's pages, so
+// nearly all the time goes to kernel accesses through the
+// direct map, and it shows the cost of the kernel's TLB
+// misses. compare a kernel that maps RAM with 4096-byte
+// pages; cat /statistics shows the kernel page table.
+//
+// usage: kvmbench [npages [rounds]]
+//
+
+#include "kernel/param.h"
+#include "kernel/fcntl.h"
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+#define FILE "kb.file"
+#define BUFPAGES 16
+
+char buf[BUFPAGES*PGSIZE];
+int npage = 512;
+int rounds = 50;
+
+void
+err(char *why)
+{
+  printf("kvmbench: %s failed\n", why);
+  unlink(FILE);
+  exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int fd, n, t0, t;
+
+  if(argc > 1)
+    npage = atoi(argv[1]);
+  if(argc > 2)
+    rounds = atoi(argv[2]);
+  if(npage <= 0 || rounds <= 0){
+    fprintf(2, "usage: kvmbench [npages [rounds]]\n");
+    exit(1);
+  }
+
+  unlink(FILE);
+  if((fd = open(FILE, O_WRONLY | O_CREATE)) < 0)
+    err("create");
+  memset(buf, 'k', PGSIZE);
+  for(int i = 0; i < npage; i++)
+    if(write(fd, buf, PGSIZE) != PGSIZE)
+      err("write");
+  close(fd);
+
+  t0 = uptime();
+  for(int r = 0; r < rounds; r++){
+    if((fd = open(FILE, O_RDONLY)) < 0)
+      err("open");
+    while((n = read(fd, buf, sizeof(buf))) > 0)
+      if(buf[n-1] != 'k')
+        err("content");
+    if(n < 0)
+      err("read");
+    close(fd);
+  }
+  t = uptime() - t0;
+  printf("read %d pages x %d: %d ticks", npage, rounds, t);
+  if(t > 0)
+    printf(", %d KB/tick", npage * (PGSIZE/1024) * rounds / t);
+  printf("\n");
+
+  unlink(FILE);
+  exit(0);
+}
@@ -0,0 +1,148 @@
+//
+// mmap scan benchmark, for fault-around and madvise.
+// makes a file of npages (default 256), then reads it
+// through read() and through mmap() mappings with each
+// kind of advice, touching one byte per page, rounds times
+// (default 20) each. reports ticks for each way.
+//
+// usage: mmapbench [npages [rounds]]
+//
+
+#include "kernel/param.h"
+#include "kernel/fcntl.h"
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/riscv.h"
+#include "kernel/fs.h"
+#include "user/user.h"
+
+#define FILE "mb.file"
+#define MAP_FAILED ((char *) -1)
+
+char buf[PGSIZE];
+int npage = 256;
+int rounds = 20;
+
+void
+err(char *why)
+{
+  printf("mmapbench: %s failed\n", why);
+  unlink(FILE);
+  exit(1);
+}
+
+void
+makefile(void)
+{
+  int fd;
+
+  unlink(FILE);
+  if((fd = open(FILE, O_WRONLY | O_CREATE)) < 0)
+    err("create");
+  for(int i = 0; i < npage; i++){
+    memset(buf, 'a' + i % 26, PGSIZE);
+    if(write(fd, buf, PGSIZE) != PGSIZE)
+      err("write");
+  }
+  close(fd);
+}
+
+// check page i of the file, as read by one of the ways.
+void
+check(int i, char c)
+{
+  if(c != 'a' + i % 26)
+    err("content");
+}
+
+void
+scanread(void)
+{
+  int fd;
+
+  if((fd = open(FILE, O_RDONLY)) < 0)
+    err("open");
+  for(int i = 0; i < npage; i++){
+    if(read(fd, buf, PGSIZE) != PGSIZE)
+      err("read");
+    check(i, buf[0]);
+  }
+  close(fd);
+}
+
+// map the file, with flags and advice, and touch each page.
+void
+scanmap(int flags, int advice)
+{
+  int fd;
+  char *p;
+
+  if((fd = open(FILE, O_RDONLY)) < 0)
+    err("open");
+  p = mmap(0, npage*PGSIZE, PROT_READ, MAP_PRIVATE | flags, fd, 0);
+  if(p == MAP_FAILED)
+    err("mmap");
+  close(fd);
+  if(advice >= 0 && madvise(p, npage*PGSIZE, advice) < 0)
+    err("madvise");
+  for(int i = 0; i < npage; i++)
+    check(i, p[i*PGSIZE]);
+  if(munmap(p, npage*PGSIZE) < 0)
+    err("munmap");
+}
+
+void
+report(char *what, int t0)
+{
+  printf("%s: %d pages x %d: %d ticks\n", what, npage, rounds, uptime() - t0);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int t0;
+
+  if(argc > 1)
+    npage = atoi(argv[1]);
+  if(argc > 2)
+    rounds = atoi(argv[2]);
+  if(npage <= 0 || rounds <= 0){
+    fprintf(2, "usage: mmapbench [npages [rounds]]\n");
+    exit(1);
+  }
+
+  makefile();
+
+  t0 = uptime();
+  for(int r = 0; r < rounds; r++)
+    scanread();
+  report("read", t0);
+
+  t0 = uptime();
+  for(int r = 0; r < rounds; r++)
+    scanmap(0, MADV_RANDOM);
+  report("mmap, one page per fault", t0);
+
+  t0 = uptime();
+  for(int r = 0; r < rounds; r++)
+    scanmap(0, -1);
+  report("mmap, fault-around", t0);
+
+  t0 = uptime();
+  for(int r = 0; r < rounds; r++)
+    scanmap(0, MADV_SEQUENTIAL);
+  report("mmap, MADV_SEQUENTIAL", t0);
+
+  t0 = uptime();
+  for(int r = 0; r < rounds; r++)
+    scanmap(0, MADV_WILLNEED);
+  report("mmap, MADV_WILLNEED", t0);
+
+  t0 = uptime();
+  for(int r = 0; r < rounds; r++)
+    scanmap(MAP_POPULATE, -1);
+  report("mmap, MAP_POPULATE", t0);
+
+  unlink(FILE);
+  exit(0);
+}
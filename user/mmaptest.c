@@ -8,6 +8,9 @@
 
 void mmap_test();
 void fork_test();
+void vma_test();
+void msync_test();
+void madvise_test();
 char buf[BSIZE];
 
 #define MAP_FAILED ((char *) -1)
@@ -17,6 +20,9 @@ main(int argc, char *argv[])
 {
   mmap_test();
   fork_test();
+  vma_test();
+  msync_test();
+  madvise_test();
   printf("mmaptest: all tests succeeded\n");
   exit(0);
 }
@@ -201,6 +207,48 @@ mmap_test(void)
     err("munmap (4)");
 
   printf("test not-mapped unmap: OK\n");
+
+  printf("test read into mmap\n");
+
+  //
+  // read() into a shared mapping: the kernel stores to the
+  // mapped page, not the program. the page must still be
+  // written to the file when it is unmapped.
+  //
+  makefile(f);
+  if ((fd = open(f, O_RDWR)) == -1)
+    err("open");
+  p = mmap(0, PGSIZE*2, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap (6)");
+  if (close(fd) == -1)
+    err("close");
+  int fd3;
+  if ((fd3 = open("mmap3", O_RDWR|O_CREATE)) < 0)
+    err("open mmap3");
+  if (write(fd3, "readinto", 8) != 8)
+    err("write mmap3");
+  close(fd3);
+  if ((fd3 = open("mmap3", O_RDONLY)) < 0)
+    err("open mmap3");
+  if (read(fd3, p + PGSIZE, 8) != 8)
+    err("read into mapping");
+  close(fd3);
+  unlink("mmap3");
+  if (munmap(p, PGSIZE*2) == -1)
+    err("munmap (5)");
+  if ((fd = open(f, O_RDONLY)) == -1)
+    err("open");
+  for (i = 0; i < PGSIZE + 8; i += 8) {
+    if (read(fd, buf, 8) != 8)
+      err("read (3)");
+  }
+  if (memcmp(buf, "readinto", 8) != 0)
+    err("file does not contain data read into mapping");
+  if (close(fd) == -1)
+    err("close");
+
+  printf("test read into mmap: OK\n");
     
   printf("test mmap two files\n");
   
@@ -297,3 +345,268 @@ fork_test(void)
   printf("fork_test OK\n");
 }
 
+
+//
+// create a file of n pages, page i filled with 'a'+i.
+//
+void
+makepages(const char *f, int n)
+{
+  int i, j;
+
+  unlink(f);
+  int fd = open(f, O_WRONLY | O_CREATE);
+  if (fd == -1)
+    err("open");
+  for (i = 0; i < n; i++) {
+    memset(buf, 'a' + i, BSIZE);
+    for (j = 0; j < PGSIZE/BSIZE; j++) {
+      if (write(fd, buf, BSIZE) != BSIZE)
+        err("write makepages");
+    }
+  }
+  if (close(fd) == -1)
+    err("close");
+}
+
+//
+// many mappings, a hole unmapped in the middle of one,
+// and adjacent mappings of a file that merge.
+//
+void
+vma_test(void)
+{
+  int fd, i, pid, status;
+  char *p, *q, *ps[40];
+  const char * const f = "mmap.vma";
+
+  printf("vma_test starting\n");
+  testname = "vma_test";
+
+  printf("test many mappings\n");
+  // neighbours with different protection don't merge, so
+  // these are 40 VMAs, more than the old 16 slots.
+  makepages(f, 3);
+  if ((fd = open(f, O_RDONLY)) == -1)
+    err("open");
+  for (i = 0; i < 40; i++) {
+    ps[i] = mmap(0, PGSIZE, i % 2 ? PROT_READ : PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE, fd, (i % 3) * PGSIZE);
+    if (ps[i] == MAP_FAILED)
+      err("mmap many");
+  }
+  for (i = 0; i < 40; i++) {
+    if (ps[i][0] != 'a' + i % 3 || ps[i][PGSIZE-1] != 'a' + i % 3)
+      err("many mismatch");
+  }
+  for (i = 0; i < 40; i += 2)
+    ps[i][0] = 'Z';
+  for (i = 0; i < 40; i++) {
+    if (munmap(ps[i], PGSIZE) == -1)
+      err("munmap many");
+  }
+  printf("test many mappings: OK\n");
+
+  printf("test unmap middle\n");
+  p = mmap(0, PGSIZE*3, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap middle");
+  if (munmap(p + PGSIZE, PGSIZE) == -1)
+    err("munmap middle");
+  if (p[0] != 'a' || p[PGSIZE*2] != 'c' || p[PGSIZE*3-1] != 'c')
+    err("middle mismatch");
+  p[0] = 'X';
+  p[PGSIZE*2] = 'Y';
+  // both pieces are copied by fork, too.
+  if ((pid = fork()) < 0)
+    err("fork");
+  if (pid == 0) {
+    if (p[0] != 'X' || p[PGSIZE*2] != 'Y' || p[PGSIZE*2+1] != 'c')
+      exit(1);
+    exit(0);
+  }
+  status = -1;
+  wait(&status);
+  if (status != 0)
+    err("middle mismatch in child");
+  if (munmap(p, PGSIZE) == -1 || munmap(p + PGSIZE*2, PGSIZE) == -1)
+    err("munmap pieces");
+  printf("test unmap middle: OK\n");
+
+  printf("test merge\n");
+  // consecutive pages of the file mapped one after another
+  // land next to each other and merge into one VMA, so there
+  // can be more of them than there are VMA slots.
+  p = mmap(0, PGSIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap merge");
+  for (i = 1; i < NVMA + 8; i++) {
+    q = mmap(0, PGSIZE, PROT_READ, MAP_PRIVATE, fd, i * PGSIZE);
+    if (q == MAP_FAILED)
+      err("mmap merge (more than NVMA)");
+    if (q != p + i * PGSIZE)
+      err("merge not adjacent");
+  }
+  for (i = 0; i < 3; i++) {
+    if (p[i * PGSIZE] != 'a' + i || p[(i+1) * PGSIZE - 1] != 'a' + i)
+      err("merge mismatch");
+  }
+  if (munmap(p, (NVMA + 8) * PGSIZE) == -1)
+    err("munmap merge");
+  if (close(fd) == -1)
+    err("close");
+  unlink(f);
+  printf("test merge: OK\n");
+
+  printf("vma_test OK\n");
+}
+
+//
+// msync() writes a shared mapping's dirty pages to the
+// file, where read() sees them.
+//
+void
+msync_test(void)
+{
+  int fd, fd1, i;
+  char *p;
+  const char * const f = "mmap.sync";
+
+  printf("msync_test starting\n");
+  testname = "msync_test";
+
+  makefile(f);
+  if ((fd = open(f, O_RDWR)) == -1)
+    err("open");
+  p = mmap(0, PGSIZE*2, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap");
+
+  printf("test msync sync\n");
+  for (i = 0; i < 100; i++)
+    p[i] = 'S';
+  p[PGSIZE + 10] = 'T';
+  if (msync(p, PGSIZE*2, MS_SYNC) == -1)
+    err("msync MS_SYNC");
+  if ((fd1 = open(f, O_RDONLY)) == -1)
+    err("open");
+  if (read(fd1, buf, 100) != 100)
+    err("read (1)");
+  for (i = 0; i < 100; i++) {
+    if (buf[i] != 'S')
+      err("file does not contain msync'ed data");
+  }
+  if (read(fd1, buf, 100) != 100 || buf[0] != 'A')
+    err("msync wrote too much");
+  close(fd1);
+  printf("test msync sync: OK\n");
+
+  printf("test msync async\n");
+  p[PGSIZE] = 'U';
+  if (msync(p + PGSIZE, PGSIZE, MS_ASYNC) == -1)
+    err("msync MS_ASYNC");
+  if ((fd1 = open(f, O_RDONLY)) == -1)
+    err("open");
+  for (i = 0; i < PGSIZE/BSIZE; i++) {
+    if (read(fd1, buf, BSIZE) != BSIZE)
+      err("read (2)");
+  }
+  if (read(fd1, buf, BSIZE) != BSIZE)
+    err("read (3)");
+  if (buf[0] != 'U' || buf[10] != 'T' || buf[1] != 'A')
+    err("file does not contain msync'ed data (2)");
+  close(fd1);
+  if (msync(p, PGSIZE, MS_SYNC | MS_ASYNC) != -1)
+    err("msync with both MS_SYNC and MS_ASYNC should have failed");
+  printf("test msync async: OK\n");
+
+  if (munmap(p, PGSIZE*2) == -1)
+    err("munmap");
+  close(fd);
+  unlink(f);
+  printf("msync_test OK\n");
+}
+
+//
+// MADV_DONTNEED drops pages, writing a shared mapping's dirty
+// ones back first, so touching them again reads the file.
+// MAP_POPULATE loads the whole mapping up front.
+//
+void
+madvise_test(void)
+{
+  int fd, fd1, i;
+  char *p;
+  const char * const f = "mmap.adv";
+
+  printf("madvise_test starting\n");
+  testname = "madvise_test";
+
+  makefile(f);
+  if ((fd = open(f, O_RDWR)) == -1)
+    err("open");
+
+  printf("test dontneed shared\n");
+  p = mmap(0, PGSIZE*2, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap (1)");
+  for (i = 0; i < 100; i++)
+    p[i] = 'D';
+  if (madvise(p, PGSIZE, MADV_DONTNEED) == -1)
+    err("madvise shared");
+  for (i = 0; i < PGSIZE; i++) {
+    if (p[i] != (i < 100 ? 'D' : 'A'))
+      err("shared page after DONTNEED does not hold the file's contents");
+  }
+  if ((fd1 = open(f, O_RDONLY)) == -1)
+    err("open");
+  if (read(fd1, buf, 100) != 100 || buf[0] != 'D' || buf[99] != 'D')
+    err("DONTNEED did not write back the dirty page");
+  close(fd1);
+  if (munmap(p, PGSIZE*2) == -1)
+    err("munmap (1)");
+  printf("test dontneed shared: OK\n");
+
+  printf("test dontneed private\n");
+  p = mmap(0, PGSIZE*2, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap (2)");
+  p[0] = 'P';
+  p[PGSIZE] = 'P';
+  if (madvise(p, PGSIZE*2, MADV_DONTNEED) == -1)
+    err("madvise private");
+  if (p[0] != 'D' || p[PGSIZE] != 'A' || p[PGSIZE*2-1] != 0)
+    err("private page after DONTNEED does not hold the file's contents");
+  if (munmap(p, PGSIZE*2) == -1)
+    err("munmap (2)");
+  printf("test dontneed private: OK\n");
+
+  printf("test populate\n");
+  close(fd);
+  makefile(f);
+  if ((fd = open(f, O_RDWR)) == -1)
+    err("open");
+  p = mmap(0, PGSIZE*2, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap (3)");
+  _v1(p);
+  if (munmap(p, PGSIZE*2) == -1)
+    err("munmap (3)");
+  p = mmap(0, PGSIZE*2, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+  if (p == MAP_FAILED)
+    err("mmap (4)");
+  _v1(p);
+  p[1] = 'Q';
+  if (munmap(p, PGSIZE*2) == -1)
+    err("munmap (4)");
+  if ((fd1 = open(f, O_RDONLY)) == -1)
+    err("open");
+  if (read(fd1, buf, 2) != 2 || buf[0] != 'A' || buf[1] != 'Q')
+    err("file does not contain populated mapping's modifications");
+  close(fd1);
+  printf("test populate: OK\n");
+
+  close(fd);
+  unlink(f);
+  printf("madvise_test OK\n");
+}
@@ -0,0 +1,108 @@
+//
+// sequential read benchmark, for read-ahead.
+// writes a bigfile-sized file (or nblock blocks),
+// then reads it back a block at a time and in
+// larger chunks, reporting ticks and the buffer
+// cache counters for each pass.
+//
+// usage: readbench [nblock]
+//
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fs.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+#define CHUNK 8   // blocks per read in the second pass
+
+char buf[CHUNK*BSIZE];
+char stats[4096];
+
+// return the value following key in the statistics report.
+int
+statval(char *key)
+{
+  char *c;
+  int n = strlen(key);
+
+  memset(stats, 0, sizeof(stats));
+  statistics(stats, sizeof(stats)-1);
+  for(c = stats; *c; c++){
+    if(memcmp(c, key, n) == 0)
+      return atoi(c+n);
+  }
+  return 0;
+}
+
+void
+pass(char *name, int nblock, int chunk)
+{
+  int fd, t0, hit0, miss0, pre0;
+
+  fd = open("rb.file", O_RDONLY);
+  if(fd < 0){
+    printf("readbench: cannot open rb.file\n");
+    exit(-1);
+  }
+  hit0 = statval("hit ");
+  miss0 = statval("miss ");
+  pre0 = statval("prefetch ");
+  t0 = uptime();
+  for(int i = 0; i < nblock; i += chunk){
+    int n = chunk;
+    if(n > nblock - i)
+      n = nblock - i;
+    if(read(fd, buf, n*BSIZE) != n*BSIZE){
+      printf("readbench: read error at block %d\n", i);
+      exit(-1);
+    }
+    for(int j = 0; j < n; j++){
+      if(*(int*)(buf + j*BSIZE) != i + j){
+        printf("readbench: wrong data for block %d\n", i + j);
+        exit(-1);
+      }
+    }
+  }
+  printf("%s: %d ticks, hit %d miss %d prefetch %d\n", name,
+         uptime() - t0, statval("hit ") - hit0,
+         statval("miss ") - miss0, statval("prefetch ") - pre0);
+  close(fd);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int fd, nblock = MAXFILE;
+
+  if(argc > 1)
+    nblock = atoi(argv[1]);
+  if(nblock <= 0 || nblock > MAXFILE){
+    fprintf(2, "usage: readbench [nblock]\n");
+    exit(1);
+  }
+
+  unlink("rb.file");
+  fd = open("rb.file", O_CREATE | O_WRONLY);
+  if(fd < 0){
+    printf("readbench: cannot create rb.file\n");
+    exit(-1);
+  }
+  for(int i = 0; i < nblock; i++){
+    *(int*)buf = i;
+    if(write(fd, buf, BSIZE) != BSIZE){
+      printf("readbench: write error at block %d\n", i);
+      exit(-1);
+    }
+  }
+  close(fd);
+  printf("wrote %d blocks\n", nblock);
+
+  // by default the file is bigger than the buffer cache,
+  // so each pass starts with its first blocks evicted.
+  pass("1-block reads", nblock, 1);
+  pass("8-block reads", nblock, CHUNK);
+
+  unlink("rb.file");
+  exit(0);
+}
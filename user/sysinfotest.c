@@ -13,28 +13,53 @@ sinfo(struct sysinfo *info) {
 }
 
 //
-// use sbrk() to count how many free physical memory pages there are.
+// count how many free physical memory pages there are,
+// in bytes. sbrk() no longer fails when memory runs out,
+// since pages are only allocated when touched: a child
+// touches pages until it is killed, reporting each one
+// through a pipe.
 //
 int
 countfree()
 {
-  uint64 sz0 = (uint64)sbrk(0);
-  struct sysinfo info;
+  int fds[2];
   int n = 0;
+  char c;
+  int cc;
 
-  while(1){
-    if((uint64)sbrk(PGSIZE) == 0xffffffffffffffff){
-      break;
+  if(pipe(fds) < 0){
+    printf("FAIL: pipe failed\n");
+    exit(1);
+  }
+  int pid = fork();
+  if(pid < 0){
+    printf("FAIL: fork failed\n");
+    exit(1);
+  }
+  if(pid == 0){
+    close(fds[0]);
+    while(1){
+      uint64 a = (uint64)sbrk(PGSIZE);
+      if(a == 0xffffffffffffffff){
+        break;
+      }
+      *(char *)(a + PGSIZE - 1) = 1;
+      if(write(fds[1], "x", 1) != 1){
+        printf("FAIL: write failed\n");
+        exit(1);
+      }
     }
-    n += PGSIZE;
+    exit(0);
   }
-  sinfo(&info);
-  if (info.freemem != 0) {
-    printf("FAIL: there is no free mem, but sysinfo.freemem=%d\n",
-      info.freemem);
+  close(fds[1]);
+  while((cc = read(fds[0], &c, 1)) == 1)
+    n += PGSIZE;
+  if(cc < 0){
+    printf("FAIL: read failed\n");
     exit(1);
   }
-  sbrk(-((uint64)sbrk(0) - sz0));
+  close(fds[0]);
+  wait(0);
   return n;
 }
 
@@ -42,35 +67,50 @@ void
 testmem() {
   struct sysinfo info;
   uint64 n = countfree();
-  
+  uint64 free0;
+  char *a;
+
   sinfo(&info);
 
-  if (info.freemem!= n) {
-    printf("FAIL: free mem %d (bytes) instead of %d\n", info.freemem, n);
+  // the child's page tables, kernel stack etc. are free
+  // again too, so there is a little more than it got.
+  if (info.freemem < n || info.freemem - n > 100*PGSIZE) {
+    printf("FAIL: free mem %d (bytes), but a process could allocate %d\n",
+      info.freemem, n);
     exit(1);
   }
-  
-  if((uint64)sbrk(PGSIZE) == 0xffffffffffffffff){
+  free0 = info.freemem;
+
+  if((a = sbrk(PGSIZE)) == (char *)0xffffffffffffffff){
     printf("sbrk failed");
     exit(1);
   }
 
   sinfo(&info);
-    
-  if (info.freemem != n-PGSIZE) {
-    printf("FAIL: free mem %d (bytes) instead of %d\n", n-PGSIZE, info.freemem);
+
+  if (info.freemem != free0) {
+    printf("FAIL: free mem %d (bytes) instead of %d before touching the page\n",
+      info.freemem, free0);
     exit(1);
   }
-  
+
+  a[0] = 1;
+  sinfo(&info);
+
+  if (info.freemem != free0-PGSIZE) {
+    printf("FAIL: free mem %d (bytes) instead of %d\n", info.freemem, free0-PGSIZE);
+    exit(1);
+  }
+
   if((uint64)sbrk(-PGSIZE) == 0xffffffffffffffff){
     printf("sbrk failed");
     exit(1);
   }
 
   sinfo(&info);
-    
-  if (info.freemem != n) {
-    printf("FAIL: free mem %d (bytes) instead of %d\n", n, info.freemem);
+
+  if (info.freemem != free0) {
+    printf("FAIL: free mem %d (bytes) instead of %d\n", info.freemem, free0);
     exit(1);
   }
 }
@@ -34,6 +34,8 @@ int connect(uint32, uint16, uint16);
 int symlink(char *target, char *path);
 void* mmap(void *addr, int length, int prot, int flags, int fd, int offset);
 int munmap(void *addr, int length);
+int msync(void *addr, int length, int flags);
+int madvise(void *addr, int length, int advice);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -51,3 +53,6 @@ void free(void*);
 int atoi(const char*);
 int memcmp(const void *, const void *, uint);
 void *memcpy(void *, const void *, uint);
+
+// statistics.c
+int statistics(void*, int);
@@ -2304,11 +2304,13 @@ sbrkfail(char *s)
   if(pid == 0){
     // allocate a lot of memory.
     // this should produce a page fault,
-    // and thus not complete.
+    // and thus not complete. pages are only allocated
+    // when stored to: reading maps the shared zero page.
     a = sbrk(0);
     sbrk(10*BIG);
     int n = 0;
     for (i = 0; i < 10*BIG; i += PGSIZE) {
+      *(a+i) = 1;
       n += *(a+i);
     }
     // print n so the compiler doesn't optimize away
@@ -45,3 +45,5 @@ entry("connect");
 entry("symlink");
 entry("mmap");
 entry("munmap");
+entry("msync");
+entry("madvise");